@@ -29,6 +29,10 @@
  * SUCH DAMAGE.
  */
 
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE	/* recvmmsg() */
+#endif
+
 #include <stdio.h>
 #include <stdbool.h>
 #include <errno.h>
@@ -44,6 +48,18 @@
 #include <sys/ioctl.h>
 #include <ctype.h>
 #include <time.h>
+#include <sys/timerfd.h>
+#include <sys/wait.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/icmp6.h>
+#include <net/if.h>
+#include <sys/un.h>
+#include <stdarg.h>
+#include <limits.h>
+#include <arpa/inet.h>
+#include <linux/netlink.h>
+#include <linux/rtnetlink.h>
 
 #include "lib/bluetooth.h"
 #include "lib/hci.h"
@@ -62,10 +78,52 @@
 #define DEBUG_PRINT(...)
 #endif
 
-#define DEFAULT_SCANNING_WINDOW   5
-#define DEFAULT_SCANNING_INTERVAL 10
-#define MAX_SCANNING_WINDOW       30
-#define MAX_SCANNING_INTERVAL     300
+/*
+ * USDT probes of provider bluetooth_6lowpand, built in with -DUSDT_6LOWPAN and sys/sdt.h
+ * of SystemTap. A probe is a nop until bpftrace, perf or stap attaches to it:
+ *
+ *   adv_report(bdaddr_t *addr, u8 type, s8 rssi, u8 len)  advertising report received,
+ *                                                         mgmt address type and data length
+ *   parse(int rule, u32 checks)                           parse_ip_service() verdict, the
+ *                                                         matching rule or -1 and the
+ *                                                         conditions checked
+ *   whitelist(bdaddr_t *addr, bool allowed, u8 len)       check_whitelist() result and
+ *                                                         prefix length of the rule
+ *   pair_start(bdaddr_t *addr, u8 type)                   pairing requested
+ *   pair_done(bdaddr_t *addr, u8 status)                  pairing completed, mgmt status
+ *   connect(bdaddr_t *addr, bool connect, bool ok)        connect_device() result
+ */
+#ifdef USDT_6LOWPAN
+#include <sys/sdt.h>
+#define TRACE_PROBE2(name, a, b) DTRACE_PROBE2(bluetooth_6lowpand, name, a, b)
+#define TRACE_PROBE3(name, a, b, c) DTRACE_PROBE3(bluetooth_6lowpand, name, a, b, c)
+#define TRACE_PROBE4(name, a, b, c, d) DTRACE_PROBE4(bluetooth_6lowpand, name, a, b, c, d)
+#else
+#define TRACE_PROBE2(...)
+#define TRACE_PROBE3(...)
+#define TRACE_PROBE4(...)
+#endif
+
+/* Scanning times are in milliseconds. */
+#define DEFAULT_SCANNING_WINDOW   5000
+#define DEFAULT_SCANNING_INTERVAL 10000
+#define MIN_SCANNING_TIME         10
+#define MAX_SCANNING_WINDOW       30000
+#define MAX_SCANNING_INTERVAL     300000
+#define DEFAULT_SCAN_BACKOFF      32    /* Largest multiple of the interval while idle or full. */
+#define DIRECT_TIMEOUT            5000  /* ms a direct connection attempt may take. */
+#define CONN_PENDING_TIMEOUT      30000 /* ms after which a connection attempt is given up on. */
+#define PAIR_TIMEOUT              40000 /* ms a pairing may take, beyond the 30 s SMP timeout. */
+#define CONNECT_TIMEOUT           10000 /* ms until a written connect has to bring the link up. */
+#define RETRY_DELAY               10000 /* ms before a node which timed out is admitted again. */
+#define RETRY_SHIFT_MAX           5     /* Retry delay doubles per timeout, up to 32 times. */
+#define HCI_EVENT_BATCH           16    /* HCI events read by one system call. */
+
+/* LE scan parameters of the controller, in 0.625 ms units. */
+#define DEFAULT_LE_SCAN_INTERVAL  0x0010
+#define DEFAULT_LE_SCAN_WINDOW    0x0004
+#define LE_SCAN_TIME_MIN          0x0004
+#define LE_SCAN_TIME_MAX          0x4000
 
 #define MAX_BLE_CONN              8
 #define IPSP_UUID                 0x1820 /* IPSP service UUID */
@@ -84,23 +142,144 @@
 #define EIR_DEVICE_ID             0x10  /* device ID */
 #define EIR_MANUF_SPECIFIC_DATA   0xFF  /* manufacture specific data */
 
+#define DEFAULT_MATCH_RULE        "uuid=1820" /* IPSP service, ssid is added with -a. */
+#define MAX_MATCH_RULES           8
+#define MAX_MATCH_CONDS           8
+#define ADV_TYPE_UNKNOWN          0xff  /* PDU type is not reported by kernel discovery. */
+
 #define DEVICE_NAME_LEN           30
 #define DEVICE_ADDR_LEN           18
 
 #define CONTROLLER_PATH           "/sys/kernel/debug/bluetooth/6lowpan_control"
+#define ENABLE_PATH               "/sys/kernel/debug/bluetooth/6lowpan_enable"
+#define PSM_PATH                  "/sys/kernel/debug/bluetooth/6lowpan_psm"
+#define MODULE_PATH               "/sys/module/bluetooth_6lowpan"
+#define MODULE_NAME               "bluetooth_6lowpan"
+#define IPSP_PSM                  "35"
+#define SETUP_TIMEOUT             5000 /* ms to wait for the module and HCI device. */
+#define SETUP_POLL_INTERVAL       10   /* ms between checks of the debugfs nodes. */
+#define CONFIG_DIR                "/etc/bluetooth"
 #define CONFIG_PATH               "/etc/bluetooth/bluetooth_6lowpand.conf"
 #define CONFIG_SWP_PATH           "/etc/bluetooth/bluetooth_6lowpand.conf.swp"
+#define CONFIG_JOURNAL_PATH       "/etc/bluetooth/bluetooth_6lowpand.conf.journal"
+#define WHITELIST_COMPACT_RECORDS 256   /* Journal records before the daemon compacts it. */
+#define WHITELIST_COMPACT_DELAY   1000  /* ms from a long journal to its compaction. */
 #define CONFIG_LINE_MAX           256
+#define OPTIONS_PATH              "/etc/bluetooth/bluetooth_6lowpand.options"
+#define OPTIONS_RESTART           "ikdsPNMCmIAE" /* Options a reload does not change. */
+#define KEYS_PATH                 "/etc/bluetooth/bluetooth_6lowpand.keys"
+#define KEYS_TMP_PATH             "/etc/bluetooth/bluetooth_6lowpand.keys.tmp"
+#define KEYS_MAGIC                0x4b4c3601 /* Version 1 of the bonding key store. */
+#define MAX_STORED_LTK            (4 * MAX_BLE_CONN * 8)
+#define MAX_STORED_IRK            (MAX_BLE_CONN * 8)
 
 #define AUTH_SSID_MAX_LEN         16  /* 16 characters of Service Set Identifier. */
 #define AUTH_KEY_LEN              6   /* Currently passkey is used instead of OOB. Key has to have exactly 6 numeric character. */
+#define MAX_AUTH_CREDS            16  /* SSID and Key pairs, one per logical network. */
+#define AUTH_CRED_SLOTS           32  /* Power of two, twice MAX_AUTH_CREDS. */
+#define AUTH_WIFI_ALL             -1  /* -n all, every wifi-iface section. */
 
 #define WIFI_CONFIG_PATH          "/etc/config/wireless"
-#define WIFI_CMD_SSID             "uci get wireless.@wifi-iface[%d].ssid"
-#define WIFI_CMD_KEY              "uci get wireless.@wifi-iface[%d].key"
+#define WIFI_IFACE_SECTION        "wifi-iface"
 #define KEY_MAX_LEN               6
 #define BUFF_SIZE                 64
 
+#define DEFAULT_WHITELIST_MAX     1024  /* Entries preallocated for the whitelist cache. */
+#define DEFAULT_NODES_MAX         128   /* Nodes tracked by the connection scheduler. */
+#define POOL_SIZE_MAX             65536 /* Largest pool -M and -C may ask for. */
+
+#define SCORE_SUCCESS_WEIGHT      20    /* dB bonus of a node, which always connected. */
+#define SCORE_AGING               1     /* dB bonus per second a candidate is waiting. */
+#define NODE_STALE_TIME           60000 /* ms unseen, after which a candidate waits anew. */
+#define RSSI_SMOOTHING            4     /* Weight of a new RSSI report is 1/RSSI_SMOOTHING. */
+
+#define LINK_STATE_PATH           "/var/run/bluetooth_6lowpand.links"
+#define DEFAULT_LINK_INTERVAL     10000 /* ms between two link quality samples. */
+#define LINK_HISTORY              16    /* RSSI samples kept per node. */
+#define LINK_RECYCLE_SAMPLES      3     /* Samples below threshold before link is recycled. */
+#define LINK_RSSI_NONE            127   /* Recycling disabled. */
+#define DEFAULT_LOWPAN_IFACE      "bt0" /* 6LoWPAN interface, probed and restored. */
+#define MAX_IFACE_ADDRS           4     /* Addresses restored on the 6LoWPAN interface. */
+#define PROBE_LOSS_LIMIT          3     /* Echoes lost in a row before the node is reconnected. */
+#define MAX_PROBE_TARGETS         4     /* Nodes probed without a BLE link. */
+#define PROBE_RTT_SMOOTHING       4     /* Weight of the last RTT is 1 / 2^n. */
+#define LINK_MAX_TX_OCTETS        251   /* Largest LL payload with Data Length Extension. */
+#define LINK_MAX_TX_TIME          2120  /* us to send 251 octets on the 1M PHY. */
+#define LINK_DEFAULT_OCTETS       27    /* LL payload without Data Length Extension. */
+#define LINK_DEFAULT_TIME         328   /* us to send 27 octets on the 1M PHY. */
+#define LE_PHY_1M                 0x01
+#define LE_PHY_2M                 0x02
+#define LE_PHY_CODED              0x03
+#define LE_FEATURE_DATA_LENGTH    0x0020 /* Local LE features, bit 5. */
+#define LE_FEATURE_2M_PHY         0x0100 /* Local LE features, bit 8. */
+#define LE_STATE_SCAN_INITIATING  (1ULL << 23) /* Active scanning while initiating. */
+#define LE_STATE_SCAN_MASTER      (1ULL << 25) /* Active scanning with master links. */
+
+/* Bluetooth 4.2 and 5.0 commands and events, not known to older BlueZ headers. */
+#ifndef OCF_LE_SET_DATA_LENGTH
+#define OCF_LE_SET_DATA_LENGTH    0x0022
+#endif
+#ifndef OCF_LE_SET_PHY
+#define OCF_LE_SET_PHY            0x0032
+#endif
+#ifndef EVT_LE_DATA_LENGTH_CHANGE
+#define EVT_LE_DATA_LENGTH_CHANGE 0x07
+#endif
+#ifndef EVT_LE_PHY_UPDATE_COMPLETE
+#define EVT_LE_PHY_UPDATE_COMPLETE 0x0C
+#endif
+
+struct link_set_data_length_cp {
+	uint16_t     handle;
+	uint16_t     tx_octets;
+	uint16_t     tx_time;
+} __attribute__ ((packed));
+
+struct link_set_data_length_rp {
+	uint8_t      status;
+	uint16_t     handle;
+} __attribute__ ((packed));
+
+struct link_set_phy_cp {
+	uint16_t     handle;
+	uint8_t      all_phys;
+	uint8_t      tx_phys;
+	uint8_t      rx_phys;
+	uint16_t     phy_options;
+} __attribute__ ((packed));
+
+struct link_data_length_change_evt {
+	uint16_t     handle;
+	uint16_t     max_tx_octets;
+	uint16_t     max_tx_time;
+	uint16_t     max_rx_octets;
+	uint16_t     max_rx_time;
+} __attribute__ ((packed));
+
+struct link_phy_update_evt {
+	uint8_t      status;
+	uint16_t     handle;
+	uint8_t      tx_phy;
+	uint8_t      rx_phy;
+} __attribute__ ((packed));
+#define LINE_BUFF_SIZE            4096  /* Fixed buffer used to read configuration files. */
+#define STATS_PATH                "/var/run/bluetooth_6lowpand.stats"
+#define DEFAULT_PIDFILE           "/var/run/bluetooth_6lowpand.pid"
+#define STATS_INTERVAL            60000 /* ms between checks of the memory budget. */
+#define EVENTS_PATH               "/var/run/bluetooth_6lowpand.sock"
+#define STATE_PATH                "/var/run/bluetooth_6lowpand.state"
+#define STATE_TMP_PATH            "/var/run/bluetooth_6lowpand.state.tmp"
+#define STATE_MAGIC               0x53543601 /* Version 1 of the state snapshot. */
+#define STATE_INTERVAL            30000 /* ms between two snapshots of the runtime state. */
+#define MAX_EVENT_CLIENTS         8     /* Subscribers of the event socket. */
+
+#define DISCOVERY_TYPE_LE         0x06  /* (1 << BDADDR_LE_PUBLIC) | (1 << BDADDR_LE_RANDOM) */
+#define DISCOVERY_RSSI_NONE       127   /* Do not filter discovery results on RSSI. */
+#define ADD_DEVICE_AUTO_CONNECT   0x02  /* Kernel reconnects the device whenever it advertises. */
+#define MGMT_STATUS_UNKNOWN_CMD   0x01
+#define MGMT_STATUS_CONN_FAILED   0x04
+#define MGMT_STATUS_TIMED_OUT     0x08
+
 /* Possible commisioning authentication. */
 enum commissioning_auth_t {
 	COMMISSIONING_AUTH_NONE = 0x00,
@@ -114,15 +293,355 @@ static int dev_id = -1;
 static volatile int signal_received;
 static unsigned int scanning_window = DEFAULT_SCANNING_WINDOW;
 static unsigned int scanning_interval = DEFAULT_SCANNING_INTERVAL;
+static uint16_t	    le_scan_interval = DEFAULT_LE_SCAN_INTERVAL;
+static uint16_t	    le_scan_window = DEFAULT_LE_SCAN_WINDOW;
+
+/* Options file, read at startup and again on SIGHUP or the reload command. */
+struct options_parse {
+	bool	     reload;
+	unsigned int line;
+	int	     errors;
+};
+
+static const char   *options_path = OPTIONS_PATH;
+static bool	    options_given = false;
+static char	    *options_fixed[128];	/* Startup values of OPTIONS_RESTART, one per line. */
+static bool	    options_argv[128];		/* Given on the command line, the file does not override. */
+static char	    *hci_id;
+static bool	    daemonize = false;
 
 /* Authentication parameters. */
 static bool	     mgmt_initialized = false;
 static struct mgmt   *mgmt;
 static unsigned int  auth_type = COMMISSIONING_AUTH_NONE;
-static char          auth_ssid_value[AUTH_SSID_MAX_LEN+1];
-static unsigned int  auth_ssid_len;
-static char          auth_key_value[AUTH_KEY_LEN+1];
 static int	     auth_wifi_iface;
+static char	     *auth_creds_path;
+
+/* SSID and passkey of one logical network, a node pairs with the one its SSID selects. */
+struct auth_cred {
+	char	     ssid[AUTH_SSID_MAX_LEN + 1];
+	unsigned int ssid_len;
+	char	     key[AUTH_KEY_LEN + 1];
+};
+
+/* Credentials of -a come first, then those of the credentials file and WiFi sections. */
+static struct auth_cred auth_creds[MAX_AUTH_CREDS];
+static unsigned int  auth_cred_count;
+static unsigned int  auth_arg_count;
+static uint8_t	     auth_cred_slots[AUTH_CRED_SLOTS];	/* Credential plus one by SSID hash. */
+
+/* Bonding keys of paired nodes, persisted in KEYS_PATH. */
+static struct mgmt_ltk_info ltk_store[MAX_STORED_LTK];
+static unsigned int	    ltk_count;
+static struct mgmt_irk_info irk_store[MAX_STORED_IRK];
+static unsigned int	    irk_count;
+
+/* Preallocated pools, sized at startup and reported on SIGUSR1. */
+enum pool_id {
+	POOL_WHITELIST = 0,
+	POOL_LTK,
+	POOL_IRK,
+	POOL_NODES,
+	POOL_COUNT
+};
+
+static struct {
+	const char   *name;
+	unsigned int size;
+	unsigned int used;
+	unsigned int high_water;
+} pools[POOL_COUNT] = {
+	[POOL_WHITELIST] = { "whitelist",	DEFAULT_WHITELIST_MAX	},
+	[POOL_LTK]	 = { "ltk",		MAX_STORED_LTK		},
+	[POOL_IRK]	 = { "irk",		MAX_STORED_IRK		},
+	[POOL_NODES]	 = { "nodes",		DEFAULT_NODES_MAX	},
+};
+
+/* Memory budget in kB, 0 means no budget. */
+static unsigned long max_rss;
+static unsigned long rss_budget_exceeded;
+static int	     stats_timeout_id = -1;
+
+/* Connection parameter profile, intervals in 1.25ms and timeout in 10ms units. */
+struct conn_profile {
+	const char   *name;
+	uint16_t     min_interval;
+	uint16_t     max_interval;
+	uint16_t     latency;
+	uint16_t     timeout;
+};
+
+enum {
+	PROFILE_DEFAULT = 0,
+	PROFILE_THROUGHPUT,
+	PROFILE_LOWPOWER,
+	PROFILE_COUNT
+};
+
+/* Default profile keeps the parameters chosen by the kernel. */
+static const struct conn_profile conn_profiles[PROFILE_COUNT] = {
+	[PROFILE_DEFAULT]    = { "default",	0x0000, 0x0000, 0, 0x0000 },
+	[PROFILE_THROUGHPUT] = { "throughput",	0x0006, 0x000c, 0, 0x0064 },
+	[PROFILE_LOWPOWER]   = { "lowpower",	0x0050, 0x00a0, 4, 0x0258 },
+};
+
+/* Profile of nodes without a profile in their whitelist entry. */
+static unsigned int  default_profile = PROFILE_DEFAULT;
+
+/* Whitelist rule, an address prefix with the connection parameter profile of its nodes. */
+struct whitelist_entry {
+	bool	     used;
+	bool	     deny;
+	uint8_t	     len;		/* Prefix length in bytes, 6 for an exact address. */
+	bdaddr_t     bdaddr;		/* Address with the bytes past the prefix cleared. */
+	unsigned int profile;
+};
+
+/*
+ * Whitelist cache, reloaded when the configuration file changes. Rules are kept in
+ * one open addressing table keyed by prefix length and prefix, so a lookup costs one
+ * probe per prefix length in use.
+ */
+static struct whitelist_entry *whitelist;
+static unsigned int  whitelist_slots;
+static unsigned int  whitelist_lengths;	/* Bit n set if rules of length n exist. */
+static unsigned int  whitelist_count;
+static struct mgmt_cp_load_conn_param *conn_params;
+static struct stat   whitelist_stat;
+
+/* Whitelist rule as written in the snapshot or the journal. */
+struct whitelist_rule {
+	char	     rule[2 * DEVICE_ADDR_LEN];
+	bool	     deny;
+	unsigned int profile;
+};
+
+/* Rules replayed from the snapshot and the journal, as many as the whitelist pool. */
+static struct whitelist_rule *whitelist_rules;
+static unsigned int  whitelist_rule_count;
+static unsigned int  journal_records;
+static struct stat   journal_stat;
+static bool	     whitelist_loaded = false;
+static int	     compact_timeout_id = -1;
+
+/* Advertisement match conditions, in the order they are checked: cheapest first. */
+enum match_kind {
+	MATCH_TYPE = 0,		/* Advertising PDU type, from the report header. */
+	MATCH_RSSI,		/* Minimum RSSI, from the report header. */
+	MATCH_COMPANY,		/* Company ID of the manufacturer data. */
+	MATCH_DATA,		/* Manufacturer data prefix under a mask. */
+	MATCH_UUID16,
+	MATCH_UUID32,
+	MATCH_NAME,		/* Local name prefix. */
+	MATCH_UUID128,
+	MATCH_SSID,		/* Nordic manufacturer data carrying the SSID of -a. */
+};
+
+struct match_cond {
+	uint8_t	     kind;
+	int8_t	     value;		/* PDU type or minimum RSSI. */
+	uint8_t	     len;
+	uint8_t	     data[16];		/* As advertised, UUIDs little-endian. */
+	uint8_t	     mask[16];
+};
+
+/* Match rule, all its conditions have to hold. */
+struct match_rule {
+	unsigned int count;
+	struct match_cond cond[MAX_MATCH_CONDS];
+};
+
+/* Rules compiled from -r options, a device is a candidate if any of them matches. */
+static struct match_rule match_rules[MAX_MATCH_RULES];
+static unsigned int  match_rule_count;
+static char	     match_rule_args[MAX_MATCH_RULES][CONFIG_LINE_MAX];
+static unsigned int  match_rule_arg_count;
+
+/* AD structures of an advertising report, first one of each kind. */
+enum adv_field {
+	FIELD_MANUF = 0,
+	FIELD_NAME,
+	FIELD_UUID16,
+	FIELD_UUID32,
+	FIELD_UUID128,
+	FIELD_COUNT
+};
+
+struct adv_fields {
+	bool	      parsed;
+	const uint8_t *ptr[FIELD_COUNT];
+	uint8_t	      len[FIELD_COUNT];
+	unsigned int  cred;		/* Credential matched by ssid, plus one. */
+};
+
+/* Last WiFi configuration parsed by read_wifi_cfg(), and the result of parsing it. */
+static struct stat   wifi_cfg_stat;
+static bool	     wifi_cfg_loaded = false;
+static int	     wifi_cfg_result;
+
+/* Node seen by scanning, ranked by the connection scheduler. */
+struct node {
+	bool	     used;
+	bool	     queued;		/* In the admit queue, kept from eviction. */
+	bool	     connected;		/* Link is up, kept from eviction. */
+	bool	     probe_target;	/* Probed without a link, kept from eviction. */
+	bdaddr_t     bdaddr;
+	uint8_t	     addr_type;
+	uint8_t	     ssid_len;		/* SSID advertised, selects the passkey when pairing. */
+	uint8_t	     ssid[AUTH_SSID_MAX_LEN];
+	int	     rssi_avg;		/* Smoothed RSSI in 1/16 dBm. */
+	unsigned int attempts;
+	unsigned int successes;
+	unsigned int timeouts;		/* Pairings or connects timed out in a row. */
+	uint64_t     retry_after;	/* Not admitted again before, after a timeout. */
+	uint64_t     connect_deadline;	/* Written connect, until the link is up. */
+	unsigned int seen_cycle;	/* Scanning cycle the node was last seen in. */
+	uint64_t     last_seen;
+	uint64_t     waiting_since;	/* First report since the node was admitted. */
+
+	/* Link quality of the connection, sampled by the link monitor. */
+	uint16_t     handle;
+	int8_t	     link_rssi[LINK_HISTORY];
+	unsigned int link_samples;
+	unsigned int link_channels;	/* Used data channels of the channel map. */
+	unsigned int link_low;		/* Consecutive samples below threshold. */
+	unsigned int link_recycles;
+	unsigned int profile;		/* Profile requested for the connection. */
+
+	/* Negotiated Data Length and PHY of the connection. */
+	uint16_t     tx_octets;
+	uint16_t     rx_octets;
+	uint8_t	     tx_phy;
+	uint8_t	     rx_phy;
+
+	/* IPv6 reachability over the 6LoWPAN interface, from the ICMPv6 prober. */
+	bool	     probe_pending;
+	uint64_t     probe_sent_at;
+	unsigned int probe_sent;
+	unsigned int probe_received;
+	unsigned int probe_lost;	/* Echoes lost in a row. */
+	unsigned int rtt_avg;		/* Smoothed round trip time in ms. */
+};
+
+/* Node as kept in the state snapshot, for a warm restart. */
+struct node_state {
+	bdaddr_t     bdaddr;
+	uint8_t	     addr_type;
+	uint8_t	     connected;
+	uint8_t	     profile;
+	uint8_t	     tx_phy;
+	uint8_t	     rx_phy;
+	int16_t	     rssi_avg;
+	uint16_t     tx_octets;
+	uint16_t     rx_octets;
+	uint32_t     attempts;
+	uint32_t     successes;
+	uint32_t     link_recycles;
+} __attribute__ ((packed));
+
+static struct node_state *state_buf;	/* One record per node of the pool. */
+static int	     state_timeout_id = -1;
+
+/* Connection scheduler state. */
+static struct node   *nodes;
+static unsigned int  nodes_used;
+static unsigned int  scan_cycle_count;
+static struct node   *admit_queue[MAX_BLE_CONN];	/* Ring of admitted candidates. */
+static unsigned int  admit_head;
+static unsigned int  admit_len;
+
+/* Link monitor parameters. */
+static unsigned int  link_interval = DEFAULT_LINK_INTERVAL;
+static int	     link_rssi_threshold = LINK_RSSI_NONE;
+static int	     link_timeout_id = -1;
+static uint16_t	     le_features;	/* Data Length and 2M PHY support of the controller. */
+
+/* 6LoWPAN interface, restored with its addresses when the kernel recreates it. */
+static const char    *lowpan_iface = DEFAULT_LOWPAN_IFACE;
+static char	     *lowpan_hook;
+static int	     netif_fd = -1;
+static int	     netif_index;	/* Interface instance seen last. */
+static bool	     netif_up;		/* Addresses of netif_index are restored. */
+static unsigned int  netif_addr_count;
+static struct {
+	struct in6_addr addr;
+	unsigned char   prefixlen;
+} netif_addrs[MAX_IFACE_ADDRS];
+
+/* ICMPv6 prober parameters, interval 0 disables the prober. */
+static unsigned int  probe_interval;
+static unsigned int  probe_ifindex;
+static int	     probe_fd = -1;
+static int	     probe_timeout_id = -1;
+static uint16_t	     probe_ident;
+static bdaddr_t	     probe_targets[MAX_PROBE_TARGETS];
+static unsigned int  probe_target_count;
+
+/* Startup and readiness parameters. */
+static bool	     mgmt_required = false;
+static bool	     setup_6lowpan = false;
+static const char    *pidfile_path;
+static int	     notify_fd = -1;
+static unsigned int  wait_index;
+static int	     index_timeout_id = -1;
+
+/* Event socket, pushing one JSON object per line to its subscribers. */
+static int	     events_fd = -1;
+static int	     event_clients[MAX_EVENT_CLIENTS] = { [0 ... MAX_EVENT_CLIENTS - 1] = -1 };
+
+/* Userspace scanning state, times are CLOCK_MONOTONIC milliseconds. */
+static int	     hci_dd = -1;
+static bool	     whitelist_enabled = false;
+static bool	     scan_enabled = false;
+static bool	     pairing_in_progress = false;
+static bdaddr_t	     pairing_bdaddr;
+static uint8_t	     pairing_addr_type;
+static int	     pair_timeout_id = -1;
+static int	     connect_timeout_id = -1;	/* Armed for the earliest connect deadline. */
+static bool	     scan_paused = false;	/* Window open, controller busy initiating. */
+static bool	     scan_concurrent = false;	/* Controller scans while initiating. */
+static bool	     conn_pending = false;
+static uint64_t	     conn_pending_since;
+static int	     scan_window_id = -1;
+static int	     scan_cycle_id = -1;
+static uint64_t	     scan_cycle_start;
+
+/* Ring of HCI events, filled by one recvmmsg() per batch. */
+static uint8_t	     hci_ring[HCI_EVENT_BATCH][HCI_MAX_EVENT_SIZE];
+static struct iovec  hci_iov[HCI_EVENT_BATCH];
+static struct mmsghdr hci_msgs[HCI_EVENT_BATCH];
+static uint64_t	     scan_next_cycle;
+
+/* Cycles are stretched by scan_backoff while idle or full, up to scan_backoff_max. */
+static unsigned int  scan_backoff = 1;
+static unsigned int  scan_backoff_max = DEFAULT_SCAN_BACKOFF;
+
+/* Direct connection of white listed nodes, without waiting for their advertising. */
+static bool	     direct_connect = false;
+static bool	     direct_active = false;	/* Round of attempts in progress. */
+static bool	     direct_missed;		/* A node did not connect, scanning looks for it. */
+static unsigned int  direct_pos;		/* Whitelist slot the next attempt starts at. */
+static unsigned int  direct_visited;		/* Whitelist slots looked at in this round. */
+static unsigned int  direct_budget;		/* Attempts left in this round. */
+static unsigned int  direct_connected;		/* Attempts of this round which connected. */
+static bdaddr_t	     direct_bdaddr;		/* Node of the pending attempt. */
+static int	     direct_timeout_id = -1;
+
+/* Kernel-managed discovery parameters. */
+static bool	     kernel_discovery = false;
+static bool	     discovery_active = false;
+static unsigned int  discovery_added;	/* Devices put on the auto-connect list by discovery. */
+static int	     discovery_timeout_id = -1;
+
+/* Addresses on the kernel auto-connect list, as many as the whitelist pool. */
+static struct mgmt_addr_info *autoconnect;
+static unsigned int  autoconnect_count;
+
+/* IPSP service UUID (0x1820) in 128-bit little-endian form, as used by mgmt. */
+static const uint8_t ipsp_uuid128[16] = {
+	0xfb, 0x34, 0x9b, 0x5f, 0x80, 0x00, 0x00, 0x80,
+	0x00, 0x10, 0x00, 0x00, 0x20, 0x18, 0x00, 0x00
+};
 
 /* Help menu */
 static void usage(void)
@@ -135,1130 +654,6144 @@ static void usage(void)
 		"\t-i dev\tSet the HCI device. Default is hci0\n"
 		"\t-t scanning interval\tSet the scanning interval. Default value is 10 seconds\n"
 		"\t-w scanning window\tSet the scanning window. Default value is 5 seconds\n"
+		"\t-b backoff\tStretch the interval up to backoff times while idle or full. Default is 32\n"
 		"\t-W\tOnly scan the device in white list\n"
-		"\t-a\tAuthentication of node.\tFormat SSID:KEY (e.g. OpenWRT:123456) else first WiFi configuration is used\n"
-		"\t-n\tSet the WiFi instance. Default is 0\n"
+		"\t-D\tConnect white listed nodes directly, scan only for wildcard rules or missed nodes\n"
+		"\t-a\tAuthentication of node.\tFormat SSID:KEY (e.g. OpenWRT:123456), up to 16 times, else WiFi configuration is used\n"
+		"\t-K file\tRead SSID:KEY pairs from file, one per line\n"
+		"\t-n\tSet the WiFi instance, or all. Default is 0\n"
+		"\t-p profile\tConnection parameters of nodes: default, throughput or lowpower\n"
+		"\t-e interval\tProbe connected nodes with ICMPv6 echoes. Disabled by default\n"
+		"\t-E BDADDR\tProbe the node also without a BLE link, up to 4 times\n"
+		"\t-I iface\t6LoWPAN interface, probed and restored. Default is bt0\n"
+		"\t-A addr/len\tIPv6 address restored on the 6LoWPAN interface, up to 4 times\n"
+		"\t-H hook\tRun hook with interface name and up or down on interface changes\n"
+		"\t-r rule\tAccept devices matching rule, up to 8 times. Default is uuid=1820[,ssid]\n"
+		"\t-T units\tLE scan interval of the controller, in 0.625 ms units. Default is 16\n"
+		"\t-X units\tLE scan window of the controller, in 0.625 ms units. Default is 4\n"
+		"\t-c file\tOptions file, reread on SIGHUP. Default is " OPTIONS_PATH "\n"
 		"\t-d\tDaemonize\n");
 	printf("Commands:\n"
-		"\taddwl\t[BDADDR]\tAdd device into white list\n"
+		"\taddwl\t[BDADDR] [profile]\tAdd device, prefix (00:11:22:*) or range (LOW-HIGH) into white list\n"
+		"\tdenywl\t[BDADDR]\tExclude device, prefix or range from white list\n"
 		"\trmwl\t[BDADDR]\tRemove device into white list\n"
 		"\tclearwl\t\t\tClear the content of white list\n"
+		"\tcompactwl\t\tFold the white list journal into the white list\n"
 		"\tlswl\t\t\tList the content of white list\n"
-		"\tlscon\t\t\tList the 6lowpan connections\n");
+		"\tlscon\t\t\tList the 6lowpan connections\n"
+		"\twatch\t\t\tPrint connection and commissioning events as JSON lines\n"
+		"\tscan\t\t\tScan for new nodes right away, resets the backoff\n"
+		"\treload\t\t\tReread the options file without dropping links\n");
 }
 
 
-/* Signal handler. */
-static void sigint_handler(int sig)
+/* Update usage and high-water mark of a preallocated pool. */
+static void pool_set_used(enum pool_id pool, unsigned int used)
 {
-	signal_received = sig;
-
-	switch (sig) {
-	case SIGINT:
-	case SIGTERM:
-		mainloop_quit();
-		break;
-	}
+	pools[pool].used = used;
+	if (used > pools[pool].high_water)
+		pools[pool].high_water = used;
 }
 
 
-/* Validate correctness of key, using in commissioning. */
-static int validate_key(const char *key_value)
+/* Call func for each line of the file, using a fixed buffer instead of stdio. */
+static int for_each_line(int fd, bool (*func)(char *line, void *user_data),
+			 void *user_data)
 {
-	int index;
+	static char buf[LINE_BUFF_SIZE];
+	size_t len = 0;
+	ssize_t ret;
 
-	if (strlen(key_value) < AUTH_KEY_LEN)
-		return -1;
+	while (1) {
+		char *start = buf, *end;
 
-	for (index = 0; index < AUTH_KEY_LEN; index++) {
-		if (!isdigit(key_value[index]))
+		ret = read(fd, buf + len, sizeof(buf) - 1 - len);
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
 			return -1;
-	}
-
-	return 0;
-}
+		}
 
+		len += ret;
+		buf[len] = '\0';
 
-/* Validate and store authentication parameters. */
-static int validate_store_auth_params(const char *ssid_value, const char *key_value)
-{
-	int length;
+		while ((end = memchr(start, '\n', buf + len - start))) {
+			*end = '\0';
+			if (!func(start, user_data))
+				return 0;
+			start = end + 1;
+		}
 
-	if (!ssid_value || !key_value) {
-		perror("SSID and Key cannot be empty");
-		return -1;
-	}
+		len = buf + len - start;
 
-	length = strlen(ssid_value);
-	if (length > AUTH_SSID_MAX_LEN) {
-		/* Use only AUTH_SSID_MAX_LEN, the most significant bytes. */
-		length = AUTH_SSID_MAX_LEN;
-	}
+		if (ret == 0) {
+			if (len)
+				func(start, user_data);
+			return 0;
+		}
 
-	/* Store SSID value. */
-	memcpy(auth_ssid_value, ssid_value, length);
-	auth_ssid_value[length] = 0;
-	auth_ssid_len = length;
+		/* Drop lines which do not fit into the buffer. */
+		if (len == sizeof(buf) - 1)
+			len = 0;
 
-	/* Validate and store key. */
-	if (validate_key(key_value) == -1) {
-		perror("Key has to have 6 numeric character");
-		return -1;
+		memmove(buf, start, len);
 	}
-
-	memcpy(auth_key_value, key_value, AUTH_KEY_LEN);
-	auth_key_value[AUTH_KEY_LEN] = 0;
-
-	return 0;
 }
 
 
-/* Read SSID and Key from command line parameters. */
-static int read_manual_cfg(char *str)
+/* Check if the file changed since it was last read. */
+static bool file_changed(const char *path, struct stat *last, bool loaded)
 {
-	char *token = NULL;
-	char ssid_value[BUFF_SIZE];
-	char key_value[BUFF_SIZE];
+	struct stat st;
 
-	memset(ssid_value, 0, BUFF_SIZE);
-	memset(key_value, 0, BUFF_SIZE);
+	if (stat(path, &st) == -1)
+		memset(&st, 0, sizeof(st));
 
-	/* Get the SSID value */
-	token = strtok(str, ":");
-	if (token != NULL)
-		memcpy(ssid_value, token, strlen(token));
+	if (loaded && st.st_mtim.tv_sec == last->st_mtim.tv_sec &&
+	    st.st_mtim.tv_nsec == last->st_mtim.tv_nsec &&
+	    st.st_size == last->st_size && st.st_ino == last->st_ino)
+		return false;
 
-	/* Get the KEY value */
-	token = strtok(NULL, ":");
-	if (token != NULL) {
-		memcpy(key_value, token, AUTH_KEY_LEN);
-	} else {
-		perror("Key is required. Format SSID:PASSKEY e.g. SSID:123456");
-		return -1;
-	}
+	*last = st;
 
-	/* Validate and store authentication parameters. */
-	return validate_store_auth_params(ssid_value, key_value);
+	return true;
 }
 
 
-/* Read SSID and Key from WiFi configuration. */
-static int read_wifi_cfg(void)
+/* Parse "Name:   1234 kB" lines of /proc/self/status. */
+static bool parse_status_line(char *line, void *user_data)
 {
-	FILE *fp;
-	char path[64];
-	char command[64];
-	char ssid_value[BUFF_SIZE];
-	char key_value[BUFF_SIZE];
+	unsigned long *val = user_data;
 
-	memset(ssid_value, 0, BUFF_SIZE);
-	memset(key_value, 0, BUFF_SIZE);
-
-	/* Read SSID value */
-	snprintf(command, sizeof(command), WIFI_CMD_SSID, auth_wifi_iface);
-
-	fp = popen(command, "r");
-	if (fp == NULL) {
-		perror("Failed to read SSID");
-		return -1;
-	}
+	if (!strncmp(line, "VmRSS:", 6))
+		val[0] = strtoul(line + 6, NULL, 10);
+	else if (!strncmp(line, "VmHWM:", 6))
+		val[1] = strtoul(line + 6, NULL, 10);
 
-	if (fgets(path, sizeof(path)-1, fp) != NULL) {
-		memcpy(ssid_value, path, strlen(path)-1);
-	} else {
-		perror("Cannot found UCI SSID");
-		return -1;
-	}
+	return true;
+}
 
-	pclose(fp);
 
-	/* Read Key value */
-	snprintf(command, sizeof(command), WIFI_CMD_KEY, auth_wifi_iface);
+/* Read current and peak resident set size in kB. */
+static int read_rss(unsigned long *rss, unsigned long *hwm)
+{
+	unsigned long val[2] = { 0, 0 };
+	int fd;
 
-	fp = popen(command, "r");
-	if (fp == NULL) {
-		perror("Failed to read KEY");
+	fd = open("/proc/self/status", O_RDONLY);
+	if (fd < 0)
 		return -1;
-	}
 
-	if (fgets(path, sizeof(path)-1, fp) != NULL) {
-		memcpy(key_value, path, strlen(path)-1);
-	} else {
-		perror("Cannot found UCI KEY");
-		return -1;
-	}
+	for_each_line(fd, parse_status_line, val);
+	close(fd);
 
-	pclose(fp);
+	*rss = val[0];
+	*hwm = val[1];
 
-	/* Validate and store authentication parameters. */
-	return validate_store_auth_params(ssid_value, key_value);
+	return 0;
 }
 
 
-/* Connect the BLE 6lowpan device. */
-static bool connect_device(char *addr, bool connect)
+/* Compare resident set size against the memory budget. */
+static void stats_check(void)
 {
-	int fd;
-	bool ret = false;
-	char command[64];
+	unsigned long rss, hwm;
 
-	fd = open(CONTROLLER_PATH, O_WRONLY);
-	if (fd < 0) {
-		perror("Can not open 6lowpan controller\n");
-		return ret;
-	}
+	if (!max_rss || read_rss(&rss, &hwm) == -1)
+		return;
 
-	if (connect)
-		snprintf(command, sizeof(command), "connect %s 1", addr);
-	else
-		snprintf(command, sizeof(command), "disconnect %s 1", addr);
+	if (rss > max_rss) {
+		rss_budget_exceeded++;
+		fprintf(stderr, "RSS %lu kB exceeds budget of %lu kB\n", rss, max_rss);
+	}
+}
 
-	if (write(fd, command, sizeof(command)) > 0)
-		ret = true;
 
-	close(fd);
+/* Periodic memory budget check. */
+static void stats_timeout(int id, void *user_data)
+{
+	stats_check();
 
-	return ret;
+	mainloop_modify_timeout(id, STATS_INTERVAL);
 }
 
 
-/*  Parse EIR events for IPSP device. */
-static bool parse_ip_service(uint8_t *eir, size_t eir_len, char *buf, size_t buf_len)
+/* Write pool high-water marks and memory footprint into STATS_PATH. */
+static void stats_dump(void)
 {
-	size_t offset = 0;
-	bool ipsp_service = false;
-	bool ssid_correct = false;
-	uint8_t val[256];
+	char buf[1024];
+	unsigned long rss = 0, hwm = 0;
+	int len, i, fd;
 
-	memset(val, 0, 256);
+	read_rss(&rss, &hwm);
 
-	while (offset < eir_len) {
-		size_t field_len = eir[0];
+	len = snprintf(buf, sizeof(buf),
+		       "rss_kb %lu\nrss_peak_kb %lu\nrss_budget_kb %lu\n"
+		       "rss_budget_exceeded %lu\n", rss, hwm, max_rss,
+		       rss_budget_exceeded);
 
-		switch (eir[1]) {
-		case EIR_UUID16_SOME:
-		case EIR_UUID16_ALL:
-			put_le16(IPSP_UUID, &val[0]);
-			if (!memcmp(val, eir + 2, field_len/2))
-				ipsp_service = true;
-			break;
-		case EIR_NAME_SHORT:
-		case EIR_NAME_COMPLETE:
-			if (field_len - 1 > buf_len)
-				break;
-			memcpy(buf, &eir[2], field_len - 1);
-			break;
-		case EIR_MANUF_SPECIFIC_DATA:
-			put_le16(NORDIC_COMPANY_ID, &val[0]);
-			if (auth_type == COMMISSIONING_AUTH_WIFI_CFG) {
-				/* Reread configuration of WiFi. */
-				if (read_wifi_cfg() == -1) {
-					perror("Cannot read Wifi configuration.");
-					return 0;
-				}
-			}
+	for (i = 0; i < POOL_COUNT && len < (int) sizeof(buf); i++)
+		len += snprintf(buf + len, sizeof(buf) - len,
+				"pool %s size %u used %u high_water %u\n",
+				pools[i].name, pools[i].size, pools[i].used,
+				pools[i].high_water);
 
-			memcpy(val + 2, auth_ssid_value, auth_ssid_len);
-			if (!memcmp(val, eir + 2, auth_ssid_len + 2) &&
-				auth_ssid_len == field_len - 3)
-				ssid_correct = true;
-			break;
-		}
+	if (len > (int) sizeof(buf))
+		len = sizeof(buf);
 
-		offset += field_len + 1;
-		eir += field_len + 1;
+	fd = open(STATS_PATH, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0) {
+		perror("Open stats failed");
+		return;
 	}
 
-	return ipsp_service && (ssid_correct || (auth_type == COMMISSIONING_AUTH_NONE));
+	if (write(fd, buf, len) != len)
+		perror("Write stats failed");
+
+	close(fd);
 }
 
 
-/* Get the number of connected BLE devices */
-static int current_conn_num(int dev_id)
+/* Drop a subscriber of the event socket. */
+static void event_client_close(int i)
 {
-	int sk, conn_num;
-	struct hci_conn_list_req *cl;
-	struct hci_conn_info *ci;
+	mainloop_remove_fd(event_clients[i]);
+	close(event_clients[i]);
+	event_clients[i] = -1;
+}
 
-	sk = socket(AF_BLUETOOTH, SOCK_RAW | SOCK_CLOEXEC, BTPROTO_HCI);
-	if (sk < 0) {
-		perror("Can't allocate socket");
-		return -1;
-	}
 
-	cl = malloc(MAX_BLE_CONN * sizeof(*ci) + sizeof(*cl));
+/* Push an event to all subscribers, fields is a JSON member list or NULL. */
+static void event_emit(const char *event, const char *fields, ...)
+{
+	char buf[512];
+	va_list ap;
+	int len, n, i;
 
-	if (!cl) {
-		perror("Can't allocate memory");
-		return -1;
-	}
+	if (events_fd < 0)
+		return;
 
-	cl->dev_id = dev_id;
-	cl->conn_num = MAX_BLE_CONN;
+	len = snprintf(buf, sizeof(buf), "{\"event\":\"%s\",\"time\":%ld", event,
+		       (long) time(NULL));
 
-	if (ioctl(sk, HCIGETCONNLIST, (void *) cl)) {
-		perror("Can't get connection list");
-		return -1;
+	if (fields) {
+		buf[len++] = ',';
+		va_start(ap, fields);
+		n = vsnprintf(buf + len, sizeof(buf) - len, fields, ap);
+		va_end(ap);
+
+		if (n < 0)
+			return;
+		len += n;
+	}
+
+	/* Cut off line would not be JSON, subscribers rather miss the event. */
+	if (len > (int) sizeof(buf) - 3) {
+		fprintf(stderr, "Event %s too long, dropped\n", event);
+		return;
 	}
 
-	conn_num = cl->conn_num;
-	free(cl);
-	close(sk);
+	buf[len++] = '}';
+	buf[len++] = '\n';
 
-	return conn_num;
+	/* A subscriber that cannot take a whole line is dropped, lines never tear. */
+	for (i = 0; i < MAX_EVENT_CLIENTS; i++) {
+		if (event_clients[i] < 0)
+			continue;
+
+		if (send(event_clients[i], buf, len, MSG_DONTWAIT | MSG_NOSIGNAL) != len)
+			event_client_close(i);
+	}
 }
 
 
-/* Check if whitelist contains target address. */
-static bool check_whitelist(const char *target_addr)
+static void scheduler_kick(void);
+static void options_reload(void);
+static void keys_clear(void);
+static void whitelist_disconnect(const char *addr);
+
+
+/*
+ * Request of a subscriber, scan asks for a scanning cycle right away, reload rereads
+ * the options, clearkeys forgets the bonding keys, disconnect drops the link of a node
+ * removed from the whitelist.
+ */
+static void event_client_cb(int fd, uint32_t events, void *user_data)
 {
-	FILE *fp = NULL;
-	char item[CONFIG_LINE_MAX];
-	struct flock lock;
+	char buf[64];
+	int i = PTR_TO_INT(user_data);
+	ssize_t len = 0;
 
-	while (access(CONFIG_SWP_PATH, F_OK) != -1) {
-		/* Wait if swap file exists */
-		sleep(1);
-	}
+	if (!(events & (EPOLLERR | EPOLLHUP)))
+		len = read(fd, buf, sizeof(buf) - 1);
 
-	fp = fopen(CONFIG_PATH, "a+");
-	if (!fp) {
-		perror("Open config failed");
-		return false;
+	if (len <= 0) {
+		event_client_close(i);
+		return;
 	}
 
-	lock.l_type = F_WRLCK;
-	lock.l_start = 0;
-	lock.l_whence = SEEK_SET;
-	lock.l_len = 0;
-	lock.l_pid = getpid();
+	buf[len] = '\0';
 
-	if (((fcntl(fileno(fp), F_SETLK, &lock)) == -1) && ((errno == EAGAIN) || (errno == EACCES))) {
-		printf("file is locked\n");
-		fclose(fp);
-		return false;
-	}
+	if (!strncmp(buf, "reload", 6))
+		options_reload();
 
-	/* Check address in conf. */
-	while ((fgets(item, sizeof(item), fp) != NULL)) {
-		char *pch;
+	if (!strncmp(buf, "clearkeys", 9))
+		keys_clear();
 
-		pch = strchr(item, '"');
-		if (pch) {
-			if (!strncasecmp(pch+1, target_addr, 17)) {
-				printf("%s is in white list\n", target_addr);
-				fflush(fp);
-				fsync(fileno(fp));
-				fclose(fp);
-				return true;
-			}
-		}
-		memset(item, 0, sizeof(item));
-	}
+	if (!strncmp(buf, "disconnect ", 11))
+		whitelist_disconnect(buf + 11);
 
-	printf("%s is not in white list\n", target_addr);
-	fclose(fp);
-	return false;
+	if (!strncmp(buf, "scan", 4) || !strncmp(buf, "reload", 6))
+		scheduler_kick();
 }
 
 
-/* Scan the IPSP device */
-static bool scan_ipsp_device(int dd, unsigned int timeout, char *dev_name, char *dev_addr, bool use_whitelist)
+/* New subscriber on the event socket. */
+static void events_accept(int fd, uint32_t events, void *user_data)
 {
-	/* device scan parameters */
-	uint8_t own_type = LE_PUBLIC_ADDRESS;
-	uint8_t scan_type = 0x01; /* Active scanning. */
-	uint8_t filter_policy = 0x00;
-	uint16_t interval = htobs(0x0010);
-	uint16_t window = htobs(0x0004);
-	uint8_t filter_dup = 0x01;
-
-	unsigned char buf[HCI_MAX_EVENT_SIZE], *ptr;
-	struct hci_filter nf, of;
-	struct sigaction sa;
-	socklen_t olen;
-	struct pollfd pollfd;
-	int poll_ret;
-	bool scan_ret = false;
-	int err;
-	time_t start_time;
-	time_t curr_time;
-	double running_time;
+	int client, i;
 
-	start_time = time(NULL);
+	/* Sends use MSG_DONTWAIT, reads happen on EPOLLIN only, blocking is fine. */
+	client = accept(fd, NULL, NULL);
+	if (client < 0)
+		return;
 
-	/* Scan BLE devices */
-	err = hci_le_set_scan_parameters(dd, scan_type, interval, window, own_type, filter_policy, 10000);
-	if (err < 0) {
-		perror("Set scan parameters failed");
-		return scan_ret;
+	for (i = 0; i < MAX_EVENT_CLIENTS; i++) {
+		if (event_clients[i] < 0)
+			break;
 	}
 
-	err = hci_le_set_scan_enable(dd, 0x01, filter_dup, 10000);
-	if (err < 0) {
-		perror("Enable scan failed");
-		return scan_ret;
+	if (i == MAX_EVENT_CLIENTS) {
+		fprintf(stderr, "Too many event subscribers\n");
+		close(client);
+		return;
 	}
 
-	DEBUG_PRINT("LE Scan ...\n");
+	event_clients[i] = client;
+	mainloop_add_fd(client, EPOLLIN, event_client_cb, INT_TO_PTR(i), NULL);
+}
 
-	olen = sizeof(of);
-	if (getsockopt(dd, SOL_HCI, HCI_FILTER, &of, &olen) < 0) {
-		printf("Could not get socket options\n");
-		goto done;
-	}
 
-	hci_filter_clear(&nf);
-	hci_filter_set_ptype(HCI_EVENT_PKT, &nf);
-	hci_filter_set_event(EVT_LE_META_EVENT, &nf);
+/* Listen for subscribers of connection and commissioning events. */
+static void events_init(void)
+{
+	struct sockaddr_un addr;
 
-	if (setsockopt(dd, SOL_HCI, HCI_FILTER, &nf, sizeof(nf)) < 0) {
-		printf("Could not set socket options\n");
-		goto done;
+	events_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (events_fd < 0) {
+		perror("Could not open event socket");
+		return;
 	}
 
-	memset(&sa, 0, sizeof(sa));
-	sa.sa_flags = SA_NOCLDSTOP;
-	sa.sa_handler = sigint_handler;
-	sigaction(SIGINT, &sa, NULL);
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strncpy(addr.sun_path, EVENTS_PATH, sizeof(addr.sun_path) - 1);
 
-	while (timeout > 0) {
-		evt_le_meta_event *meta;
-		le_advertising_info *info;
-		char addr[DEVICE_ADDR_LEN];
-		char name[DEVICE_NAME_LEN];
+	unlink(EVENTS_PATH);
+	if (bind(events_fd, (struct sockaddr *) &addr, sizeof(addr)) < 0 ||
+	    listen(events_fd, MAX_EVENT_CLIENTS) < 0) {
+		perror("Could not listen on event socket");
+		close(events_fd);
+		events_fd = -1;
+		return;
+	}
 
-		curr_time = time(NULL);
-		running_time = difftime(curr_time, start_time);
+	mainloop_add_fd(events_fd, EPOLLIN, events_accept, NULL, NULL);
+}
 
-		if (running_time > timeout)
-			goto done;
 
-		memset(name, 0, sizeof(name));
-		memset(addr, 0, sizeof(addr));
-		memset(buf, 0, sizeof(buf));
+/* Signal handler. */
+static void signal_callback(int sig, void *user_data)
+{
+	signal_received = sig;
 
-		pollfd.fd = dd;
-		pollfd.events = POLLIN;
+	switch (sig) {
+	case SIGINT:
+	case SIGTERM:
+		mainloop_quit();
+		break;
+	case SIGUSR1:
+		stats_dump();
+		break;
+	case SIGHUP:
+		options_reload();
+		scheduler_kick();
+		break;
+	case SIGCHLD:
+		/* Reap interface hooks. */
+		while (waitpid(-1, NULL, WNOHANG) > 0)
+			;
+		break;
+	}
+}
 
-		poll_ret = poll(&pollfd, 1, (timeout - running_time)*1000);
-		if (poll_ret < 0) {
-			printf("poll hci dev error\n");
-			goto done;
-		} else if (poll_ret == 0) {
-			/* poll timeout */
-			goto done;
-		} else {
-			if (pollfd.revents & POLLIN) {
-				while ((read(dd, buf, sizeof(buf))) < 0) {
-					if (errno == EINTR && signal_received == SIGINT)
-						goto done;
 
-					if (errno == EAGAIN || errno == EINTR)
-						continue;
+/* Parse a duration into milliseconds. Plain numbers are seconds, "ms" and "s" suffixes are accepted. */
+static int parse_duration(const char *str, unsigned int *msec)
+{
+	char *end;
+	unsigned long value;
 
-					goto done;
-				}
-			}
-		}
+	errno = 0;
+	value = strtoul(str, &end, 10);
+	if (errno || end == str)
+		return -1;
+
+	if (!strcmp(end, "ms")) {
+		/* Already in milliseconds. */
+	} else if (!strcmp(end, "s") || *end == '\0') {
+		/* Unsigned long may be 32 bits, check before it can wrap. */
+		if (value > UINT32_MAX / 1000)
+			return -1;
+		value *= 1000;
+	} else {
+		return -1;
+	}
+
+	if (value > UINT32_MAX)
+		return -1;
+
+	*msec = value;
+
+	return 0;
+}
+
+
+/* Parse a decimal number between min and max, the whole string has to be the number. */
+static int parse_number(const char *str, unsigned long min, unsigned long max,
+			unsigned int *number)
+{
+	char *end;
+	unsigned long value;
+
+	errno = 0;
+	value = strtoul(str, &end, 10);
+	if (errno || end == str || *end || value < min || value > max)
+		return -1;
+
+	*number = value;
+
+	return 0;
+}
+
+
+/* Parse a signed decimal number within [min, max], the whole string has to be used. */
+static int parse_signed(const char *str, long min, long max, int *number)
+{
+	char *end;
+	long value;
+
+	errno = 0;
+	value = strtol(str, &end, 10);
+	if (errno || end == str || *end || value < min || value > max)
+		return -1;
+
+	*number = value;
+
+	return 0;
+}
+
+
+/* Validate correctness of key, using in commissioning. */
+static int validate_key(const char *key_value)
+{
+	int index;
+
+	if (strlen(key_value) < AUTH_KEY_LEN)
+		return -1;
+
+	for (index = 0; index < AUTH_KEY_LEN; index++) {
+		if (!isdigit(key_value[index]))
+			return -1;
+	}
+
+	return 0;
+}
+
+
+/* Slot of an SSID in the credential index. */
+static unsigned int auth_cred_hash(const uint8_t *ssid, unsigned int len)
+{
+	uint32_t hash = 2166136261u ^ len;
+	unsigned int i;
+
+	for (i = 0; i < len; i++)
+		hash = (hash ^ ssid[i]) * 16777619u;
+
+	return hash & (AUTH_CRED_SLOTS - 1);
+}
+
+
+/* Credential of an SSID, as index plus one, 0 if unknown. */
+static unsigned int auth_cred_find(const uint8_t *ssid, unsigned int len)
+{
+	unsigned int slot, i;
+
+	if (len > AUTH_SSID_MAX_LEN)
+		return 0;
+
+	/* Index is never full, a free slot ends the probe. */
+	for (slot = auth_cred_hash(ssid, len); (i = auth_cred_slots[slot]);
+	     slot = (slot + 1) & (AUTH_CRED_SLOTS - 1)) {
+		const struct auth_cred *cred = &auth_creds[i - 1];
+
+		if (cred->ssid_len == len && !memcmp(cred->ssid, ssid, len))
+			return i;
+	}
+
+	return 0;
+}
+
+
+/* Validate and store authentication parameters, a known SSID gets the new key. */
+static int validate_store_auth_params(const char *ssid_value, const char *key_value)
+{
+	struct auth_cred *cred;
+	unsigned int length, i, slot;
+
+	if (!ssid_value || !key_value) {
+		perror("SSID and Key cannot be empty");
+		return -1;
+	}
+
+	length = strlen(ssid_value);
+	if (length > AUTH_SSID_MAX_LEN) {
+		/* Use only AUTH_SSID_MAX_LEN, the most significant bytes. */
+		length = AUTH_SSID_MAX_LEN;
+	}
+
+	/* Validate key. */
+	if (validate_key(key_value) == -1) {
+		perror("Key has to have 6 numeric character");
+		return -1;
+	}
+
+	i = auth_cred_find((const uint8_t *) ssid_value, length);
+	if (!i) {
+		if (auth_cred_count == MAX_AUTH_CREDS) {
+			fprintf(stderr, "Give up to %u SSID and Key pairs\n", MAX_AUTH_CREDS);
+			return -1;
+		}
+
+		i = ++auth_cred_count;
+
+		slot = auth_cred_hash((const uint8_t *) ssid_value, length);
+		while (auth_cred_slots[slot])
+			slot = (slot + 1) & (AUTH_CRED_SLOTS - 1);
+		auth_cred_slots[slot] = i;
+	}
+
+	/* Store SSID and key. */
+	cred = &auth_creds[i - 1];
+	memcpy(cred->ssid, ssid_value, length);
+	cred->ssid[length] = 0;
+	cred->ssid_len = length;
+	memcpy(cred->key, key_value, AUTH_KEY_LEN);
+	cred->key[AUTH_KEY_LEN] = 0;
+
+	return 0;
+}
+
+
+/* Drop credentials past count, the index is rebuilt for the ones kept. */
+static void auth_creds_truncate(unsigned int count)
+{
+	unsigned int i, slot;
+
+	auth_cred_count = count;
+	memset(auth_cred_slots, 0, sizeof(auth_cred_slots));
+
+	for (i = 0; i < count; i++) {
+		slot = auth_cred_hash((const uint8_t *) auth_creds[i].ssid,
+				      auth_creds[i].ssid_len);
+		while (auth_cred_slots[slot])
+			slot = (slot + 1) & (AUTH_CRED_SLOTS - 1);
+		auth_cred_slots[slot] = i + 1;
+	}
+}
+
+
+/* Read SSID and Key from command line parameters. */
+static int read_manual_cfg(char *str)
+{
+	char *token = NULL;
+	char ssid_value[BUFF_SIZE];
+	char key_value[BUFF_SIZE];
+
+	memset(ssid_value, 0, BUFF_SIZE);
+	memset(key_value, 0, BUFF_SIZE);
+
+	/* Get the SSID value */
+	token = strtok(str, ":");
+	if (token != NULL)
+		strncpy(ssid_value, token, BUFF_SIZE - 1);
+
+	/* Get the KEY value */
+	token = strtok(NULL, ":");
+	if (token != NULL) {
+		memcpy(key_value, token, AUTH_KEY_LEN);
+	} else {
+		perror("Key is required. Format SSID:PASSKEY e.g. SSID:123456");
+		return -1;
+	}
+
+	/* Validate and store authentication parameters. */
+	return validate_store_auth_params(ssid_value, key_value);
+}
+
+
+/* One SSID:KEY line of the credentials file. */
+static bool parse_creds_line(char *line, void *user_data)
+{
+	unsigned int *errors = user_data;
+	char *end;
+
+	while (isspace((unsigned char) *line))
+		line++;
+
+	for (end = line + strlen(line); end > line && isspace((unsigned char) end[-1]); end--)
+		;
+	*end = '\0';
+
+	if (!*line || *line == '#')
+		return true;
+
+	if (read_manual_cfg(line) == -1)
+		(*errors)++;
+
+	return true;
+}
+
+
+/* Option values of the selected wifi-iface section. */
+struct wifi_cfg_parse {
+	int  section;
+	bool in_iface;
+	unsigned int found;
+	char ssid_value[BUFF_SIZE];
+	char key_value[BUFF_SIZE];
+};
+
+
+/* Copy an UCI option value, which may be quoted. */
+static void uci_value(const char *str, char *value, size_t size)
+{
+	size_t len;
+	char quote = 0;
+
+	while (isspace((unsigned char) *str))
+		str++;
+
+	if (*str == '\'' || *str == '"')
+		quote = *str++;
+
+	for (len = 0; str[len] && len < size - 1; len++) {
+		if (quote ? str[len] == quote : isspace((unsigned char) str[len]))
+			break;
+	}
+
+	memcpy(value, str, len);
+	value[len] = '\0';
+}
+
+
+/* Credentials of a parsed wifi-iface section, sections without a 6 digit key are skipped with all. */
+static void wifi_section_end(struct wifi_cfg_parse *cfg)
+{
+	if (auth_wifi_iface != AUTH_WIFI_ALL && cfg->section != auth_wifi_iface)
+		return;
+
+	if (cfg->ssid_value[0] && cfg->key_value[0] &&
+	    (auth_wifi_iface != AUTH_WIFI_ALL || !validate_key(cfg->key_value)) &&
+	    !validate_store_auth_params(cfg->ssid_value, cfg->key_value))
+		cfg->found++;
+
+	cfg->ssid_value[0] = '\0';
+	cfg->key_value[0] = '\0';
+}
+
+
+/* Parse one line of UCI wireless configuration. */
+static bool parse_wifi_line(char *line, void *user_data)
+{
+	struct wifi_cfg_parse *cfg = user_data;
+	char *token;
+
+	while (isspace((unsigned char) *line))
+		line++;
+
+	if (!strncmp(line, "config", 6) && isspace((unsigned char) line[6])) {
+		token = line + 6;
+		while (isspace((unsigned char) *token))
+			token++;
+
+		if (cfg->in_iface)
+			wifi_section_end(cfg);
+
+		cfg->in_iface = !strncmp(token, WIFI_IFACE_SECTION, strlen(WIFI_IFACE_SECTION));
+		if (cfg->in_iface)
+			cfg->section++;
+
+		/* Sections past the selected one are not needed. */
+		return auth_wifi_iface == AUTH_WIFI_ALL || cfg->section <= auth_wifi_iface;
+	}
+
+	if (!cfg->in_iface || strncmp(line, "option", 6))
+		return true;
+
+	token = line + 6;
+	while (isspace((unsigned char) *token))
+		token++;
+
+	if (!strncmp(token, "ssid", 4) && isspace((unsigned char) token[4]))
+		uci_value(token + 4, cfg->ssid_value, sizeof(cfg->ssid_value));
+	else if (!strncmp(token, "key", 3) && isspace((unsigned char) token[3]))
+		uci_value(token + 3, cfg->key_value, sizeof(cfg->key_value));
+
+	return true;
+}
+
+
+/* Rebuild the credential table: -a pairs, then the credentials file, then WiFi sections. */
+static int auth_creds_refresh(void)
+{
+	static struct wifi_cfg_parse cfg;
+	unsigned int errors = 0;
+	int fd;
+
+	auth_creds_truncate(auth_arg_count);
+
+	if (auth_creds_path) {
+		fd = open(auth_creds_path, O_RDONLY);
+		if (fd < 0) {
+			perror("Failed to read credentials file");
+			return -1;
+		}
+
+		for_each_line(fd, parse_creds_line, &errors);
+		close(fd);
+
+		if (errors) {
+			fprintf(stderr, "%u invalid lines in %s\n", errors, auth_creds_path);
+			return -1;
+		}
+	}
+
+	if (auth_type != COMMISSIONING_AUTH_WIFI_CFG)
+		return auth_cred_count ? 0 : -1;
+
+	memset(&cfg, 0, sizeof(cfg));
+	cfg.section = -1;
+
+	fd = open(WIFI_CONFIG_PATH, O_RDONLY);
+	if (fd < 0) {
+		perror("Failed to read WiFi configuration");
+		return -1;
+	}
+
+	for_each_line(fd, parse_wifi_line, &cfg);
+	close(fd);
+
+	if (cfg.in_iface)
+		wifi_section_end(&cfg);
+
+	if (!cfg.found) {
+		perror("Cannot found UCI SSID and KEY");
+		return -1;
+	}
+
+	return 0;
+}
+
+
+/* Read SSID and Key from WiFi configuration. */
+static int read_wifi_cfg(void)
+{
+	/* Parse UCI file directly, it is reparsed only if it changed, also after a failure. */
+	if (!file_changed(WIFI_CONFIG_PATH, &wifi_cfg_stat, wifi_cfg_loaded))
+		return wifi_cfg_result;
+
+	wifi_cfg_loaded = true;
+	wifi_cfg_result = auth_creds_refresh();
+
+	return wifi_cfg_result;
+}
+
+
+static void netif_check(void);
+
+
+/* Connect the BLE 6lowpan device, addr_type is BDADDR_LE_PUBLIC or BDADDR_LE_RANDOM. */
+static bool connect_device(const bdaddr_t *bdaddr, uint8_t addr_type, bool connect)
+{
+	int fd, len;
+	bool ret = false;
+	char command[64];
+	char addr[DEVICE_ADDR_LEN];
+
+	fd = open(CONTROLLER_PATH, O_WRONLY);
+	if (fd < 0) {
+		perror("Can not open 6lowpan controller\n");
+		return ret;
+	}
+
+	/* Address is formatted for the kernel only. */
+	ba2str(bdaddr, addr);
+	len = snprintf(command, sizeof(command), "%s %s %u",
+		       connect ? "connect" : "disconnect", addr, addr_type);
+
+	if (write(fd, command, len) > 0)
+		ret = true;
+
+	close(fd);
+
+	TRACE_PROBE3(connect, bdaddr, connect, ret);
+
+	/* Interface may have been left down while there were no links. */
+	if (connect && ret)
+		netif_check();
+
+	return ret;
+}
+
+
+static int hex_byte(const char *str);
+
+
+/* Parse a hex string of up to max bytes, dashes of 128-bit UUIDs are skipped. */
+static int hex_parse(const char *str, uint8_t *val, unsigned int max)
+{
+	unsigned int len = 0;
+	int byte;
+
+	while (*str) {
+		if (*str == '-') {
+			str++;
+			continue;
+		}
+
+		byte = hex_byte(str);
+		if (byte < 0 || len == max)
+			return -1;
+
+		val[len++] = byte;
+		str += 2;
+	}
+
+	return len;
+}
+
+
+/* Compile one condition KEY=VALUE of a match rule. */
+static int match_cond_parse(char *token, struct match_cond *cond)
+{
+	static const char *types[] = { "ind", "direct", "scan", "nonconn", "rsp" };
+	char *value = strchr(token, '=');
+	uint8_t be[16];
+	int i, len;
+
+	memset(cond, 0, sizeof(*cond));
+
+	if (!strcmp(token, "ssid")) {
+		cond->kind = MATCH_SSID;
+		return auth_type == COMMISSIONING_AUTH_NONE ? -1 : 0;
+	}
+
+	if (!value)
+		return -1;
+
+	*value++ = '\0';
+
+	if (!strcmp(token, "type")) {
+		cond->kind = MATCH_TYPE;
+		for (i = 0; i < (int) (sizeof(types) / sizeof(types[0])); i++) {
+			if (!strcmp(value, types[i])) {
+				cond->value = i;
+				return 0;
+			}
+		}
+		return -1;
+	}
+
+	if (!strcmp(token, "rssi")) {
+		int rssi;
+
+		/* HCI reports -127 to 20 dBm, anything else would wrap in the int8_t. */
+		if (parse_signed(value, -127, 20, &rssi) == -1)
+			return -1;
+
+		cond->kind = MATCH_RSSI;
+		cond->value = rssi;
+		return 0;
+	}
+
+	if (!strcmp(token, "name")) {
+		cond->kind = MATCH_NAME;
+		cond->len = strlen(value);
+		if (!cond->len || cond->len > sizeof(cond->data))
+			return -1;
+		memcpy(cond->data, value, cond->len);
+		return 0;
+	}
+
+	if (!strcmp(token, "company")) {
+		cond->kind = MATCH_COMPANY;
+		if (hex_parse(value, be, 2) != 2)
+			return -1;
+		cond->data[0] = be[1];
+		cond->data[1] = be[0];
+		cond->len = 2;
+		return 0;
+	}
+
+	if (!strcmp(token, "data")) {
+		char *slash = strchr(value, '/');
+
+		cond->kind = MATCH_DATA;
+		if (slash)
+			*slash = '\0';
+
+		len = hex_parse(value, cond->data, sizeof(cond->data));
+		if (len <= 0)
+			return -1;
+		cond->len = len;
+
+		memset(cond->mask, 0xff, len);
+		if (slash && hex_parse(slash + 1, cond->mask, len) != len)
+			return -1;
+
+		for (i = 0; i < len; i++)
+			cond->data[i] &= cond->mask[i];
+		return 0;
+	}
+
+	if (!strcmp(token, "uuid")) {
+		/* UUIDs are written big-endian and advertised little-endian. */
+		len = hex_parse(value, be, sizeof(be));
+		if (len == 2)
+			cond->kind = MATCH_UUID16;
+		else if (len == 4)
+			cond->kind = MATCH_UUID32;
+		else if (len == 16)
+			cond->kind = MATCH_UUID128;
+		else
+			return -1;
+
+		for (i = 0; i < len; i++)
+			cond->data[i] = be[len - 1 - i];
+		cond->len = len;
+		return 0;
+	}
+
+	return -1;
+}
+
+
+/* Compile a match rule, its conditions are sorted so the cheapest is checked first. */
+static int match_rule_add(const char *str)
+{
+	struct match_rule *rule;
+	char buf[CONFIG_LINE_MAX], *token, *save;
+	unsigned int i;
+
+	if (match_rule_count == MAX_MATCH_RULES || strlen(str) >= sizeof(buf))
+		return -1;
+
+	rule = &match_rules[match_rule_count];
+	rule->count = 0;
+
+	strcpy(buf, str);
+	for (token = strtok_r(buf, ",", &save); token;
+	     token = strtok_r(NULL, ",", &save)) {
+		struct match_cond cond;
+
+		if (rule->count == MAX_MATCH_CONDS || match_cond_parse(token, &cond) == -1)
+			return -1;
+
+		for (i = rule->count; i > 0 && rule->cond[i - 1].kind > cond.kind; i--)
+			rule->cond[i] = rule->cond[i - 1];
+		rule->cond[i] = cond;
+		rule->count++;
+	}
+
+	/* A rule without conditions would accept every device. */
+	if (!rule->count)
+		return -1;
+
+	match_rule_count++;
+
+	return 0;
+}
+
+
+/* Locate the AD structures the conditions look at, in one pass over the data. */
+static void adv_fields_parse(const uint8_t *eir, size_t eir_len, struct adv_fields *f)
+{
+	size_t offset = 0;
+
+	memset(f, 0, sizeof(*f));
+	f->parsed = true;
+
+	while (offset + 1 < eir_len) {
+		size_t field_len = eir[offset];
+		unsigned int id;
+
+		if (!field_len || offset + 1 + field_len > eir_len)
+			break;
+
+		switch (eir[offset + 1]) {
+		case EIR_UUID16_SOME:
+		case EIR_UUID16_ALL:
+			id = FIELD_UUID16;
+			break;
+		case EIR_UUID32_SOME:
+		case EIR_UUID32_ALL:
+			id = FIELD_UUID32;
+			break;
+		case EIR_UUID128_SOME:
+		case EIR_UUID128_ALL:
+			id = FIELD_UUID128;
+			break;
+		case EIR_NAME_SHORT:
+		case EIR_NAME_COMPLETE:
+			id = FIELD_NAME;
+			break;
+		case EIR_MANUF_SPECIFIC_DATA:
+			id = FIELD_MANUF;
+			break;
+		default:
+			id = FIELD_COUNT;
+		}
+
+		if (id < FIELD_COUNT && !f->ptr[id]) {
+			f->ptr[id] = eir + offset + 2;
+			f->len[id] = field_len - 1;
+		}
+
+		offset += field_len + 1;
+	}
+}
+
+
+/* Check if a UUID list of the report contains the UUID of the condition. */
+static bool match_uuid(const struct adv_fields *f, unsigned int id,
+		       const struct match_cond *cond)
+{
+	unsigned int i;
+
+	for (i = 0; i + cond->len <= f->len[id]; i += cond->len) {
+		if (!memcmp(f->ptr[id] + i, cond->data, cond->len))
+			return true;
+	}
+
+	return false;
+}
+
+
+/* Check one condition, AD structures are located on first use. */
+static bool match_cond_check(const struct match_cond *cond, const uint8_t *eir,
+			     size_t eir_len, uint8_t type, int8_t rssi,
+			     struct adv_fields *f)
+{
+	const uint8_t *manuf;
+	unsigned int i;
+
+	switch (cond->kind) {
+	case MATCH_TYPE:
+		/* Kernel discovery does not report the PDU type. */
+		return type == ADV_TYPE_UNKNOWN || type == cond->value;
+	case MATCH_RSSI:
+		return rssi >= cond->value;
+	}
+
+	if (!f->parsed)
+		adv_fields_parse(eir, eir_len, f);
+
+	manuf = f->ptr[FIELD_MANUF];
+
+	switch (cond->kind) {
+	case MATCH_COMPANY:
+		return f->len[FIELD_MANUF] >= 2 && !memcmp(manuf, cond->data, 2);
+	case MATCH_DATA:
+		if (f->len[FIELD_MANUF] < cond->len)
+			return false;
+		for (i = 0; i < cond->len; i++) {
+			if ((manuf[i] & cond->mask[i]) != cond->data[i])
+				return false;
+		}
+		return true;
+	case MATCH_UUID16:
+		return match_uuid(f, FIELD_UUID16, cond);
+	case MATCH_UUID32:
+		return match_uuid(f, FIELD_UUID32, cond);
+	case MATCH_NAME:
+		return f->len[FIELD_NAME] >= cond->len &&
+		       !memcmp(f->ptr[FIELD_NAME], cond->data, cond->len);
+	case MATCH_UUID128:
+		return match_uuid(f, FIELD_UUID128, cond);
+	case MATCH_SSID:
+		if (auth_type == COMMISSIONING_AUTH_WIFI_CFG) {
+			/* Reread configuration of WiFi, a failure was reported when parsing. */
+			if (read_wifi_cfg() == -1)
+				return false;
+		}
+
+		if (f->len[FIELD_MANUF] < 2 || get_le16(manuf) != NORDIC_COMPANY_ID)
+			return false;
+
+		/* SSID of the node selects the passkey of its pairing. */
+		f->cred = auth_cred_find(manuf + 2, f->len[FIELD_MANUF] - 2);
+		return f->cred != 0;
+	}
+
+	return false;
+}
+
+
+/* Match advertising data against the rules, a rule accepts if all its conditions hold. */
+static bool parse_ip_service(const uint8_t *eir, size_t eir_len, uint8_t type, int8_t rssi,
+			     char *buf, size_t buf_len, unsigned int *cred)
+{
+	struct adv_fields f;
+	unsigned int i, j, checks = 0;
+	int accepted = -1;
+
+	f.parsed = false;
+
+	for (i = 0; i < match_rule_count && accepted < 0; i++) {
+		const struct match_rule *rule = &match_rules[i];
+
+		f.cred = 0;
+
+		for (j = 0; j < rule->count; j++) {
+			checks++;
+			if (!match_cond_check(&rule->cond[j], eir, eir_len, type, rssi, &f))
+				break;
+		}
+
+		if (j == rule->count)
+			accepted = i;
+	}
+
+	TRACE_PROBE2(parse, accepted, checks);
+
+	*cred = accepted >= 0 ? f.cred : 0;
+
+	buf[0] = '\0';
+	if (f.parsed && f.ptr[FIELD_NAME] && f.len[FIELD_NAME] <= buf_len) {
+		memcpy(buf, f.ptr[FIELD_NAME], f.len[FIELD_NAME]);
+		buf[f.len[FIELD_NAME]] = '\0';
+	}
+
+	return accepted >= 0;
+}
+
+
+/* Compile the match rules of -r, or the default IPSP rule. */
+static int match_init(void)
+{
+	char rule[CONFIG_LINE_MAX];
+	unsigned int i;
+
+	match_rule_count = 0;
+
+	for (i = 0; i < match_rule_arg_count; i++) {
+		if (match_rule_add(match_rule_args[i]) == -1) {
+			fprintf(stderr, "Invalid match rule %s\n", match_rule_args[i]);
+			return -1;
+		}
+	}
+
+	if (match_rule_count)
+		return 0;
+
+	snprintf(rule, sizeof(rule), "%s%s", DEFAULT_MATCH_RULE,
+		 auth_type != COMMISSIONING_AUTH_NONE ? ",ssid" : "");
+	match_rule_add(rule);
+
+	return 0;
+}
+
+
+/* Read the connections of the HCI device into a static buffer. */
+static struct hci_conn_list_req *read_conn_list(int dev_id)
+{
+	static uint8_t buf[sizeof(struct hci_conn_list_req) +
+			   MAX_BLE_CONN * sizeof(struct hci_conn_info)];
+	struct hci_conn_list_req *cl = (void *) buf;
+
+	cl->dev_id = dev_id;
+	cl->conn_num = MAX_BLE_CONN;
+
+	if (ioctl(hci_dd, HCIGETCONNLIST, (void *) cl)) {
+		perror("Can't get connection list");
+		return NULL;
+	}
+
+	return cl;
+}
+
+
+/* Get the number of connected BLE devices */
+static int current_conn_num(int dev_id)
+{
+	struct hci_conn_list_req *cl = read_conn_list(dev_id);
+
+	if (!cl)
+		return -1;
+
+	return cl->conn_num;
+}
+
+
+/* Look up a connection parameter profile by name. */
+static int conn_profile_find(const char *name)
+{
+	int i;
+
+	for (i = 0; i < PROFILE_COUNT; i++) {
+		if (!strcmp(conn_profiles[i].name, name))
+			return i;
+	}
+
+	return -1;
+}
+
+
+/* Slot of a rule in the whitelist table. */
+static unsigned int whitelist_hash(const bdaddr_t *bdaddr, unsigned int len)
+{
+	uint32_t hash = 2166136261u ^ len;
+	int i;
+
+	for (i = 0; i < 6; i++)
+		hash = (hash ^ bdaddr->b[i]) * 16777619u;
+
+	return hash & (whitelist_slots - 1);
+}
+
+
+/* Add a rule for the first len bytes of addr, given most significant byte first. */
+static bool whitelist_insert(const uint8_t *addr, unsigned int len, bool deny,
+			     unsigned int profile)
+{
+	struct whitelist_entry *entry;
+	bdaddr_t key;
+	unsigned int i, slot;
+
+	memset(&key, 0, sizeof(key));
+	for (i = 0; i < len; i++)
+		key.b[5 - i] = addr[i];
+
+	slot = whitelist_hash(&key, len);
+	while (whitelist[slot].used) {
+		entry = &whitelist[slot];
+
+		/* Same prefix listed twice, deny wins. */
+		if (entry->len == len && !bacmp(&entry->bdaddr, &key)) {
+			entry->deny |= deny;
+			if (profile != PROFILE_DEFAULT)
+				entry->profile = profile;
+			return true;
+		}
+
+		slot = (slot + 1) & (whitelist_slots - 1);
+	}
+
+	/* Table has twice the pool size, so probing always ends on a free slot. */
+	if (whitelist_count == pools[POOL_WHITELIST].size)
+		return false;
+
+	entry = &whitelist[slot];
+	entry->used = true;
+	entry->deny = deny;
+	entry->len = len;
+	entry->bdaddr = key;
+	entry->profile = profile;
+
+	whitelist_count++;
+	whitelist_lengths |= 1 << len;
+
+	return true;
+}
+
+
+/* Cover the range lo..hi, equal in the first d bytes, with as few prefixes as possible. */
+static bool whitelist_add_range(const uint8_t *lo, const uint8_t *hi, unsigned int d,
+				bool deny, unsigned int profile)
+{
+	bool lo_tail = true, hi_tail = true;
+	unsigned int first, last, b, i;
+	uint8_t edge[6];
+
+	for (i = d + 1; i < 6; i++) {
+		if (lo[i] != 0x00)
+			lo_tail = false;
+		if (hi[i] != 0xff)
+			hi_tail = false;
+	}
+
+	if (d == 6 || (lo_tail && hi_tail && lo[d] == 0x00 && hi[d] == 0xff))
+		return whitelist_insert(lo, d, deny, profile);
+
+	if (lo[d] == hi[d])
+		return whitelist_add_range(lo, hi, d + 1, deny, profile);
+
+	first = lo[d];
+	last = hi[d];
+
+	/* Partial subtrees at both edges, whole subtrees in between. */
+	if (!lo_tail) {
+		memcpy(edge, lo, sizeof(edge));
+		memset(edge + d + 1, 0xff, 5 - d);
+		if (!whitelist_add_range(lo, edge, d + 1, deny, profile))
+			return false;
+		first++;
+	}
+
+	if (!hi_tail)
+		last--;
+
+	for (b = first; b <= last; b++) {
+		memcpy(edge, lo, sizeof(edge));
+		edge[d] = b;
+		if (!whitelist_insert(edge, d + 1, deny, profile))
+			return false;
+	}
+
+	if (!hi_tail) {
+		memcpy(edge, hi, sizeof(edge));
+		memset(edge + d + 1, 0x00, 5 - d);
+		return whitelist_add_range(edge, hi, d + 1, deny, profile);
+	}
+
+	return true;
+}
+
+
+/* Longest rule matching the address, NULL if no rule matches. */
+static const struct whitelist_entry *whitelist_lookup(const bdaddr_t *bdaddr)
+{
+	const struct whitelist_entry *entry;
+	bdaddr_t key;
+	unsigned int len, slot;
+	int i;
+
+	for (len = 7; len-- > 0;) {
+		if (!(whitelist_lengths & (1 << len)))
+			continue;
+
+		key = *bdaddr;
+		for (i = 0; i < 6 - (int) len; i++)
+			key.b[i] = 0;
+
+		slot = whitelist_hash(&key, len);
+		while (whitelist[slot].used) {
+			entry = &whitelist[slot];
+			if (entry->len == len && !bacmp(&entry->bdaddr, &key))
+				return entry;
+			slot = (slot + 1) & (whitelist_slots - 1);
+		}
+	}
+
+	return NULL;
+}
+
+
+/* Value of two hex digits, -1 if str does not start with them. */
+static int hex_byte(const char *str)
+{
+	int i, val = 0;
+
+	for (i = 0; i < 2; i++) {
+		int c = tolower((unsigned char) str[i]);
+
+		if (!isxdigit(c))
+			return -1;
+
+		val = (val << 4) | (isdigit(c) ? c - '0' : c - 'a' + 10);
+	}
+
+	return val;
+}
+
+
+/* Parse an address, "XX:XX:XX:XX:XX:XX", into bytes, most significant first. */
+static int rule_parse_addr(const char *str, uint8_t *addr)
+{
+	int i, val;
+
+	for (i = 0; i < 6; i++) {
+		val = hex_byte(str);
+		if (val < 0)
+			return -1;
+
+		addr[i] = val;
+		str += 2;
+
+		if (*str != (i < 5 ? ':' : '\0'))
+			return -1;
+		str++;
+	}
+
+	return 0;
+}
+
+
+/* Parse a whitelist rule into an address range: exact, "XX:XX:*", "*" or "LOW-HIGH". */
+static int rule_parse(const char *str, uint8_t *lo, uint8_t *hi)
+{
+	char low[DEVICE_ADDR_LEN];
+	const char *dash;
+	int i, val;
+
+	dash = strchr(str, '-');
+	if (dash) {
+		if (dash - str != DEVICE_ADDR_LEN - 1)
+			return -1;
+
+		memcpy(low, str, DEVICE_ADDR_LEN - 1);
+		low[DEVICE_ADDR_LEN - 1] = '\0';
+
+		if (rule_parse_addr(low, lo) < 0 || rule_parse_addr(dash + 1, hi) < 0 ||
+		    memcmp(lo, hi, 6) > 0)
+			return -1;
+
+		return 0;
+	}
+
+	for (i = 0; i < 6; i++) {
+		if (!strcmp(str, "*"))
+			break;
+
+		val = hex_byte(str);
+		if (val < 0)
+			return -1;
+
+		lo[i] = hi[i] = val;
+		str += 2;
+
+		if (*str != (i < 5 ? ':' : '\0'))
+			return -1;
+		str++;
+	}
+
+	for (; i < 6; i++) {
+		lo[i] = 0x00;
+		hi[i] = 0xff;
+	}
+
+	return 0;
+}
+
+
+/* Whitelist block being parsed, a rule is added once its profile is known. */
+struct whitelist_parse {
+	struct whitelist_rule pending;
+	bool	     journal;
+	bool	     full;	/* Pool filled up, rules were left out. */
+};
+
+
+/* Index of a rule in the replayed whitelist, -1 if it is not listed. */
+static int whitelist_rule_find(const char *rule)
+{
+	unsigned int i;
+
+	for (i = 0; i < whitelist_rule_count; i++) {
+		if (!strcasecmp(whitelist_rules[i].rule, rule))
+			return i;
+	}
+
+	return -1;
+}
+
+
+/* Add the pending rule of the block being parsed, a later record replaces an earlier one. */
+static bool whitelist_commit(struct whitelist_parse *wp)
+{
+	int i;
+
+	if (!wp->pending.rule[0])
+		return true;
+
+	i = whitelist_rule_find(wp->pending.rule);
+	if (i < 0) {
+		if (whitelist_rule_count == pools[POOL_WHITELIST].size) {
+			fprintf(stderr, "Whitelist cache full, ignoring %s\n",
+				wp->pending.rule);
+			wp->pending.rule[0] = '\0';
+			wp->full = true;
+			return false;
+		}
+
+		i = whitelist_rule_count++;
+	}
+
+	whitelist_rules[i] = wp->pending;
+	wp->pending.rule[0] = '\0';
+
+	return true;
+}
+
+
+/* Parse one line of the snapshot or the journal into the replayed rules. */
+static bool parse_whitelist_line(char *line, void *user_data)
+{
+	struct whitelist_parse *wp = user_data;
+	char value[2 * DEVICE_ADDR_LEN];
+	char *pch;
+	int profile, i;
+
+	if (line[0] == '{' || line[0] == '}') {
+		if (!whitelist_commit(wp))
+			return false;
+
+		if (line[0] == '{' && wp->journal)
+			journal_records++;
+
+		wp->pending.profile = PROFILE_DEFAULT;
+		return true;
+	}
+
+	pch = strstr(line, "remove=");
+	if (pch) {
+		if (!whitelist_commit(wp))
+			return false;
+
+		uci_value(pch + 7, value, sizeof(value));
+
+		i = whitelist_rule_find(value);
+		if (i >= 0)
+			whitelist_rules[i] = whitelist_rules[--whitelist_rule_count];
+
+		journal_records++;
+		return true;
+	}
+
+	pch = strstr(line, "profile");
+	if (pch && pch[7] == '=') {
+		uci_value(pch + 8, value, sizeof(value));
+
+		profile = conn_profile_find(value);
+		if (profile < 0) {
+			fprintf(stderr, "Unknown connection profile %s\n", value);
+			return true;
+		}
+
+		wp->pending.profile = profile;
+		return true;
+	}
+
+	pch = strstr(line, "address");
+	if (pch && pch[7] == '=') {
+		if (!whitelist_commit(wp))
+			return false;
+
+		uci_value(pch + 8, wp->pending.rule, sizeof(wp->pending.rule));
+		wp->pending.deny = false;
+		return true;
+	}
+
+	pch = strstr(line, "deny");
+	if (pch && pch[4] == '=') {
+		if (!whitelist_commit(wp))
+			return false;
+
+		uci_value(pch + 5, wp->pending.rule, sizeof(wp->pending.rule));
+		wp->pending.deny = true;
+	}
+
+	return true;
+}
+
+
+/* Lock the journal, the lock guards both the journal and the snapshot. */
+static int whitelist_lock(int fd, short type, bool wait)
+{
+	struct flock lock;
+
+	lock.l_type = type;
+	lock.l_start = 0;
+	lock.l_whence = SEEK_SET;
+	lock.l_len = 0;
+	lock.l_pid = getpid();
+
+	while (fcntl(fd, wait ? F_SETLKW : F_SETLK, &lock) == -1) {
+		if (!wait || errno != EINTR)
+			return -1;
+	}
+
+	return 0;
+}
+
+
+/*
+ * Replay the journal on top of the snapshot, journal_fd is -1 if there is no journal.
+ * False if rules did not fit, such a replay must not be compacted.
+ */
+static bool whitelist_replay(int journal_fd)
+{
+	struct whitelist_parse wp;
+	int fd;
+
+	memset(&wp, 0, sizeof(wp));
+	whitelist_rule_count = 0;
+	journal_records = 0;
+
+	fd = open(CONFIG_PATH, O_RDONLY);
+	if (fd >= 0) {
+		for_each_line(fd, parse_whitelist_line, &wp);
+		whitelist_commit(&wp);
+		close(fd);
+	}
+
+	if (journal_fd < 0 || lseek(journal_fd, 0, SEEK_SET) == -1)
+		return !wp.full;
+
+	wp.journal = true;
+	wp.pending.profile = PROFILE_DEFAULT;
+	for_each_line(journal_fd, parse_whitelist_line, &wp);
+	whitelist_commit(&wp);
+
+	return !wp.full;
+}
+
+
+/* Write the replayed rules as new snapshot and empty the journal, journal must be write locked. */
+static int whitelist_compact(int journal_fd)
+{
+	static char buf[LINE_BUFF_SIZE];
+	const struct whitelist_rule *rule;
+	unsigned int i;
+	int fd, len = 0;
+
+	fd = open(CONFIG_SWP_PATH, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0) {
+		perror("Open swap config failed");
+		return -1;
+	}
+
+	for (i = 0; i <= whitelist_rule_count; i++) {
+		/* Flush before the next block could overflow the buffer. */
+		if (i == whitelist_rule_count || len > (int) sizeof(buf) - CONFIG_LINE_MAX) {
+			if (write(fd, buf, len) != len)
+				goto failed;
+			len = 0;
+		}
+
+		if (i == whitelist_rule_count)
+			break;
+
+		rule = &whitelist_rules[i];
+		len += snprintf(buf + len, sizeof(buf) - len, "{\n\t%s=\"%s\"\n",
+				rule->deny ? "deny" : "address", rule->rule);
+		if (rule->profile != PROFILE_DEFAULT)
+			len += snprintf(buf + len, sizeof(buf) - len,
+					"\tprofile=\"%s\"\n",
+					conn_profiles[rule->profile].name);
+		len += snprintf(buf + len, sizeof(buf) - len, "}\n");
+	}
+
+	if (fsync(fd) == -1)
+		goto failed;
+	close(fd);
+
+	/* Replaying the old journal on the new snapshot gives the same rules, if we stop here. */
+	if (rename(CONFIG_SWP_PATH, CONFIG_PATH) == -1) {
+		perror("Rename Fail");
+		unlink(CONFIG_SWP_PATH);
+		return -1;
+	}
+
+	/* Rename must be on disk before the journal it replaces is emptied. */
+	fd = open(CONFIG_DIR, O_RDONLY | O_DIRECTORY);
+	if (fd < 0 || fsync(fd) == -1) {
+		perror("Sync config directory failed");
+		if (fd >= 0)
+			close(fd);
+		return -1;
+	}
+	close(fd);
+
+	if (ftruncate(journal_fd, 0) == -1) {
+		perror("Truncate journal failed");
+		return -1;
+	}
+
+	fsync(journal_fd);
+	journal_records = 0;
+
+	DEBUG_PRINT("Whitelist compacted, %u rules\n", whitelist_rule_count);
+
+	return 0;
+
+failed:
+	perror("Write swap config failed");
+	close(fd);
+	unlink(CONFIG_SWP_PATH);
+	return -1;
+}
+
+
+/* Compile the replayed rules into the prefix table. */
+static void whitelist_compile(void)
+{
+	uint8_t lo[6], hi[6];
+	unsigned int i;
+
+	memset(whitelist, 0, whitelist_slots * sizeof(*whitelist));
+	whitelist_lengths = 0;
+	whitelist_count = 0;
+
+	for (i = 0; i < whitelist_rule_count; i++) {
+		const struct whitelist_rule *rule = &whitelist_rules[i];
+
+		if (rule_parse(rule->rule, lo, hi) < 0) {
+			fprintf(stderr, "Invalid whitelist rule %s\n", rule->rule);
+			continue;
+		}
+
+		if (!whitelist_add_range(lo, hi, 0, rule->deny, rule->profile)) {
+			fprintf(stderr, "Whitelist cache full, ignoring %s\n", rule->rule);
+			break;
+		}
+	}
+
+	pool_set_used(POOL_WHITELIST, whitelist_count);
+}
+
+
+static void conn_params_upload(void);
+static void discovery_load_whitelist(void);
+
+
+/* Reload whitelist cache, if the snapshot or the journal changed. */
+static void whitelist_reload(void)
+{
+	struct stat last = whitelist_stat, last_journal = journal_stat;
+	bool changed;
+	int fd;
+
+	changed = file_changed(CONFIG_PATH, &whitelist_stat, whitelist_loaded);
+	changed |= file_changed(CONFIG_JOURNAL_PATH, &journal_stat, whitelist_loaded);
+	if (!changed)
+		return;
+
+	fd = open(CONFIG_JOURNAL_PATH, O_RDWR | O_CREAT | O_APPEND, 0644);
+	if (fd >= 0 && whitelist_lock(fd, F_RDLCK, false) == -1) {
+		/* Whitelist is being written, retry on next check. */
+		whitelist_stat = last;
+		journal_stat = last_journal;
+		close(fd);
+		return;
+	}
+
+	whitelist_replay(fd);
+	whitelist_compile();
+	whitelist_loaded = true;
+
+	if (fd >= 0)
+		close(fd);
+
+	/* Journal grew long, fold it into a new snapshot off the advertising path. */
+	if (journal_records >= WHITELIST_COMPACT_RECORDS && compact_timeout_id >= 0)
+		mainloop_modify_timeout(compact_timeout_id, WHITELIST_COMPACT_DELAY);
+
+	DEBUG_PRINT("Whitelist reloaded, %u rules, %u prefixes\n",
+		    whitelist_rule_count, whitelist_count);
+
+	event_emit("whitelist_changed", "\"rules\":%u", whitelist_rule_count);
+
+	conn_params_upload();
+	discovery_load_whitelist();
+}
+
+
+/* Fold a long journal into a new snapshot, if nobody writes and every rule fits. */
+static void compact_timeout(int id, void *user_data)
+{
+	int fd;
+
+	fd = open(CONFIG_JOURNAL_PATH, O_RDWR | O_APPEND);
+	if (fd < 0)
+		return;
+
+	/* Replay again under the write lock, records may have been added since. */
+	if (whitelist_lock(fd, F_WRLCK, false) == -1) {
+		mainloop_modify_timeout(id, WHITELIST_COMPACT_DELAY);
+		close(fd);
+		return;
+	}
+
+	/* Next check sees the new snapshot and reloads from it. */
+	if (!whitelist_replay(fd))
+		fprintf(stderr, "Whitelist does not fit the cache, not compacting\n");
+	else if (journal_records >= WHITELIST_COMPACT_RECORDS)
+		whitelist_compact(fd);
+
+	close(fd);
+}
+
+
+/* Check if whitelist contains target address. */
+static bool check_whitelist(const bdaddr_t *bdaddr)
+{
+	const struct whitelist_entry *entry;
+	bool allowed;
+#ifdef DEBUG_6LOWPAN
+	char addr[DEVICE_ADDR_LEN];
+#endif
+
+	whitelist_reload();
+
+	/* Longest matching rule decides, deny rules carve out of allow rules. */
+	entry = whitelist_lookup(bdaddr);
+	allowed = entry && !entry->deny;
+
+	TRACE_PROBE3(whitelist, bdaddr, allowed, entry ? entry->len : 0);
+
+#ifdef DEBUG_6LOWPAN
+	ba2str(bdaddr, addr);
+	DEBUG_PRINT("%s is %sin white list\n", addr, allowed ? "" : "not ");
+#endif
+
+	return allowed;
+}
+
+
+static struct node *node_find(const bdaddr_t *bdaddr);
+static bool conn_list_has(const struct hci_conn_list_req *cl, const bdaddr_t *bdaddr);
+
+
+/* Drop the link of a node removed by rmwl, with the address type it connected with. */
+static void whitelist_disconnect(const char *str)
+{
+	char addr[DEVICE_ADDR_LEN];
+	struct node *node;
+	bdaddr_t bdaddr;
+
+	snprintf(addr, sizeof(addr), "%s", str);
+	if (bachk(addr) < 0)
+		return;
+
+	/* Kernel auto-connect list is brought in line first, it would reconnect the node. */
+	whitelist_reload();
+
+	str2ba(addr, &bdaddr);
+	node = node_find(&bdaddr);
+	if (!node || !conn_list_has(read_conn_list(dev_id), &bdaddr))
+		return;
+
+	if (connect_device(&node->bdaddr, node->addr_type, false))
+		printf("Device %s disconnect ok!\n", addr);
+	else
+		printf("Device %s disconnect fail!\n", addr);
+}
+
+
+/* Management API passkey request. */
+static void passkey_request_event(uint16_t index, uint16_t len,
+				  const void *param, void *user_data)
+{
+	const struct mgmt_ev_pin_code_request *ev = param;
+	static struct mgmt_cp_user_passkey_reply cp;
+	const struct node *node = node_find(&ev->addr.bdaddr);
+	unsigned int i = auth_cred_count ? 1 : 0;
+
+	/* Key of the network the node advertised, the first one if it did not tell. */
+	if (node && node->ssid_len)
+		i = auth_cred_find(node->ssid, node->ssid_len);
+
+	/* No key for it, pairing fails right away instead of at its deadline. */
+	if (!i) {
+		struct mgmt_cp_user_passkey_neg_reply neg;
+
+		memcpy(&neg.addr, &ev->addr, sizeof(neg.addr));
+		mgmt_reply(mgmt, MGMT_OP_USER_PASSKEY_NEG_REPLY, index, sizeof(neg), &neg,
+			   NULL, NULL, NULL);
+		return;
+	}
+
+	memset(&cp, 0, sizeof(cp));
+	memcpy(&cp.addr, &ev->addr, sizeof(cp.addr));
+	put_le32(atoi(auth_creds[i - 1].key), &cp.passkey);
+
+	DEBUG_PRINT("Passkey request: %d\r\n", cp.passkey);
+
+	/* Reply with correct passkey. */
+	mgmt_reply(mgmt, MGMT_OP_USER_PASSKEY_REPLY, index, sizeof(cp), &cp,
+		   NULL, NULL, NULL);
+}
+
+
+/* Management API configuration result. */
+static void set_cfg_complete(uint8_t status, uint16_t len,
+			     const void *param, void *user_data)
+{
+	const char *fn_name = user_data;
+
+	if (status) {
+		fprintf(stderr, "Configuration command %s failed - reason: %s\n",
+				fn_name, mgmt_errstr(status));
+		mainloop_quit();
+		return;
+	}
+}
+
+
+/* Management API optional configuration result. */
+static void set_cfg_complete_nonfatal(uint8_t status, uint16_t len,
+				      const void *param, void *user_data)
+{
+	const char *fn_name = user_data;
+
+	if (status)
+		fprintf(stderr, "Configuration command %s failed - reason: %s\n",
+				fn_name, mgmt_errstr(status));
+}
+
+
+/* Load bonding keys from the key store. */
+static void keys_load(void)
+{
+	int fd;
+	uint32_t header[3];
+
+	ltk_count = 0;
+	irk_count = 0;
+
+	fd = open(KEYS_PATH, O_RDONLY);
+	if (fd < 0)
+		return;
+
+	if (read(fd, header, sizeof(header)) != sizeof(header) ||
+	    header[0] != KEYS_MAGIC ||
+	    header[1] > MAX_STORED_LTK || header[2] > MAX_STORED_IRK)
+		goto fail;
+
+	if (read(fd, ltk_store, header[1] * sizeof(ltk_store[0])) !=
+	    (ssize_t) (header[1] * sizeof(ltk_store[0])))
+		goto fail;
+
+	if (read(fd, irk_store, header[2] * sizeof(irk_store[0])) !=
+	    (ssize_t) (header[2] * sizeof(irk_store[0])))
+		goto fail;
+
+	ltk_count = header[1];
+	irk_count = header[2];
+	pool_set_used(POOL_LTK, ltk_count);
+	pool_set_used(POOL_IRK, irk_count);
+
+	DEBUG_PRINT("Loaded %u LTKs and %u IRKs\n", ltk_count, irk_count);
+
+	close(fd);
+	return;
+
+fail:
+	fprintf(stderr, "Ignoring corrupted key store %s\n", KEYS_PATH);
+	close(fd);
+}
+
+
+/* Write bonding keys into the key store using atomic rename. */
+static void keys_save(void)
+{
+	int fd;
+	uint32_t header[3];
+	bool ok;
+
+	header[0] = KEYS_MAGIC;
+	header[1] = ltk_count;
+	header[2] = irk_count;
+
+	fd = open(KEYS_TMP_PATH, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+	if (fd < 0) {
+		perror("Open key store failed");
+		return;
+	}
+
+	ok = write(fd, header, sizeof(header)) == sizeof(header) &&
+	     write(fd, ltk_store, ltk_count * sizeof(ltk_store[0])) ==
+			(ssize_t) (ltk_count * sizeof(ltk_store[0])) &&
+	     write(fd, irk_store, irk_count * sizeof(irk_store[0])) ==
+			(ssize_t) (irk_count * sizeof(irk_store[0]));
+
+	fsync(fd);
+	close(fd);
+
+	if (!ok || rename(KEYS_TMP_PATH, KEYS_PATH) == -1) {
+		perror("Write key store failed");
+		unlink(KEYS_TMP_PATH);
+	}
+}
+
+
+/* Check if the node was bonded before, so pairing can be skipped. */
+static bool keys_known(const bdaddr_t *bdaddr, uint8_t addr_type)
+{
+	unsigned int i;
+
+	/* Same address of the other type is another node, its key would not match. */
+	for (i = 0; i < ltk_count; i++) {
+		if (!bacmp(&ltk_store[i].addr.bdaddr, bdaddr) &&
+		    ltk_store[i].addr.type == addr_type)
+			return true;
+	}
+
+	return false;
+}
+
+
+/* Management API new long term key event. */
+static void new_long_term_key_event(uint16_t index, uint16_t len,
+				    const void *param, void *user_data)
+{
+	const struct mgmt_ev_new_long_term_key *ev = param;
+	unsigned int i;
+
+	if (len != sizeof(*ev) || !ev->store_hint)
+		return;
+
+	/* Replace key of the same node and role, else append it. */
+	for (i = 0; i < ltk_count; i++) {
+		if (!bacmp(&ltk_store[i].addr.bdaddr, &ev->key.addr.bdaddr) &&
+		    ltk_store[i].addr.type == ev->key.addr.type &&
+		    ltk_store[i].master == ev->key.master)
+			break;
+	}
+
+	if (i == MAX_STORED_LTK) {
+		fprintf(stderr, "Key store full, LTK not stored\n");
+		return;
+	}
+
+	memcpy(&ltk_store[i], &ev->key, sizeof(ev->key));
+	if (i == ltk_count)
+		pool_set_used(POOL_LTK, ++ltk_count);
+
+	DEBUG_PRINT("New LTK stored, %u keys\n", ltk_count);
+
+	keys_save();
+}
+
+
+/* Management API new identity resolving key event. */
+static void new_irk_event(uint16_t index, uint16_t len,
+			  const void *param, void *user_data)
+{
+	const struct mgmt_ev_new_irk *ev = param;
+	unsigned int i;
+
+	if (len != sizeof(*ev) || !ev->store_hint)
+		return;
+
+	for (i = 0; i < irk_count; i++) {
+		if (!bacmp(&irk_store[i].addr.bdaddr, &ev->key.addr.bdaddr) &&
+		    irk_store[i].addr.type == ev->key.addr.type)
+			break;
+	}
+
+	if (i == MAX_STORED_IRK) {
+		fprintf(stderr, "Key store full, IRK not stored\n");
+		return;
+	}
+
+	memcpy(&irk_store[i], &ev->key, sizeof(ev->key));
+	if (i == irk_count)
+		pool_set_used(POOL_IRK, ++irk_count);
+
+	DEBUG_PRINT("New IRK stored, %u keys\n", irk_count);
+
+	keys_save();
+}
+
+
+/* Register for key distribution events of pairing. */
+static void keys_register(void)
+{
+	mgmt_register(mgmt, MGMT_EV_NEW_LONG_TERM_KEY, dev_id,
+		      new_long_term_key_event, NULL, NULL);
+	mgmt_register(mgmt, MGMT_EV_NEW_IRK, dev_id,
+		      new_irk_event, NULL, NULL);
+}
+
+
+/* Hand the keys in memory over to the kernel, replacing the ones it has. */
+static void keys_send(uint16_t index)
+{
+	static uint8_t ltk_buf[sizeof(struct mgmt_cp_load_long_term_keys) +
+			       sizeof(ltk_store)];
+	static uint8_t irk_buf[sizeof(struct mgmt_cp_load_irks) +
+			       sizeof(irk_store)];
+	struct mgmt_cp_load_long_term_keys *ltk_cp = (void *) ltk_buf;
+	struct mgmt_cp_load_irks *irk_cp = (void *) irk_buf;
+	size_t len;
+
+	/* IRKs are loaded first, so resolvable addresses map on the LTK owner. */
+	put_le16(irk_count, &irk_cp->irk_count);
+	memcpy(irk_cp->irks, irk_store, irk_count * sizeof(irk_store[0]));
+	len = sizeof(*irk_cp) + irk_count * sizeof(irk_store[0]);
+	mgmt_send(mgmt, MGMT_OP_LOAD_IRKS, index, len, irk_buf,
+		  set_cfg_complete_nonfatal, "MGMT_OP_LOAD_IRKS", NULL);
+
+	put_le16(ltk_count, &ltk_cp->key_count);
+	memcpy(ltk_cp->keys, ltk_store, ltk_count * sizeof(ltk_store[0]));
+	len = sizeof(*ltk_cp) + ltk_count * sizeof(ltk_store[0]);
+	mgmt_send(mgmt, MGMT_OP_LOAD_LONG_TERM_KEYS, index, len, ltk_buf,
+		  set_cfg_complete_nonfatal, "MGMT_OP_LOAD_LONG_TERM_KEYS", NULL);
+}
+
+
+/* Hand the stored keys over to the kernel, so known nodes encrypt without pairing. */
+static void keys_upload(uint16_t index)
+{
+	keys_load();
+	keys_send(index);
+}
+
+
+/* Forget the bonding keys, in the key store, in memory and in the kernel. */
+static void keys_clear(void)
+{
+	ltk_count = 0;
+	irk_count = 0;
+	pool_set_used(POOL_LTK, 0);
+	pool_set_used(POOL_IRK, 0);
+
+	if (unlink(KEYS_PATH) == -1 && errno != ENOENT)
+		perror("Remove key store failed");
+
+	/* Empty lists replace the kernel keys, nodes pair again on their next connect. */
+	if (mgmt && dev_id >= 0 && auth_type != COMMISSIONING_AUTH_NONE)
+		keys_send(dev_id);
+
+	event_emit("keys_cleared", NULL);
+}
+
+
+/* Connection parameter profile of a node, from its whitelist entry or the default. */
+static unsigned int conn_profile_of(const bdaddr_t *bdaddr)
+{
+	const struct whitelist_entry *entry = whitelist_lookup(bdaddr);
+
+	if (entry && !entry->deny && entry->profile != PROFILE_DEFAULT)
+		return entry->profile;
+
+	return default_profile;
+}
+
+
+/* Hand the profiles of whitelisted nodes to the kernel, used when it connects them. */
+static void conn_params_upload(void)
+{
+	unsigned int i, count = 0;
+	size_t len;
+
+	if (!mgmt_initialized)
+		return;
+
+	/* Kernel keeps parameters per address, wildcard rules apply after connect. */
+	for (i = 0; i < whitelist_slots; i++) {
+		const struct conn_profile *cp;
+		struct mgmt_conn_param *param;
+		const struct node *node;
+
+		if (!whitelist[i].used || whitelist[i].deny || whitelist[i].len != 6)
+			continue;
+
+		cp = &conn_profiles[conn_profile_of(&whitelist[i].bdaddr)];
+		if (!cp->max_interval)
+			continue;
+
+		/* Address type is public, unless the node was seen with another one. */
+		node = node_find(&whitelist[i].bdaddr);
+		param = &conn_params->params[count++];
+		bacpy(&param->addr.bdaddr, &whitelist[i].bdaddr);
+		param->addr.type = node ? node->addr_type : BDADDR_LE_PUBLIC;
+		put_le16(cp->min_interval, &param->min_interval);
+		put_le16(cp->max_interval, &param->max_interval);
+		put_le16(cp->latency, &param->latency);
+		put_le16(cp->timeout, &param->timeout);
+	}
+
+	/* An empty list still clears the parameters of removed nodes. */
+	put_le16(count, &conn_params->param_count);
+	len = sizeof(*conn_params) + count * sizeof(conn_params->params[0]);
+	mgmt_send(mgmt, MGMT_OP_LOAD_CONN_PARAM, dev_id, len, conn_params,
+		  set_cfg_complete_nonfatal, "MGMT_OP_LOAD_CONN_PARAM", NULL);
+}
+
+
+static void node_connected(const bdaddr_t *bdaddr);
+static void node_timed_out(struct node *node, const char *op);
+static void commission_next(void);
+static void scan_pause(void);
+static void scan_resume(void);
+static void timeout_disarm(int id);
+
+
+/* Management API pairing result. */
+static void pair_device_complete(uint8_t status, uint16_t len,
+				 const void *param, void *user_data)
+{
+	const struct mgmt_cp_pair_device *ev = param;
+
+	char bastr[20];
+	memset(bastr, 0, 20);
+
+	if (len >= sizeof(ev->addr)) {
+		ba2str(&ev->addr.bdaddr, bastr);
+		TRACE_PROBE2(pair_done, &ev->addr.bdaddr, status);
+	}
+
+	event_emit("pairing_finished", "\"address\":\"%s\",\"status\":%u,\"error\":\"%s\"",
+		   bastr, status, mgmt_errstr(status));
+
+	/* Pairing was given up on at its deadline, another one may be running. */
+	if (!pairing_in_progress || len < sizeof(ev->addr) ||
+	    bacmp(&ev->addr.bdaddr, &pairing_bdaddr))
+		return;
+
+	timeout_disarm(pair_timeout_id);
+
+	if (status) {
+#ifdef DEBUG_6LOWPAN
+		fprintf(stderr, "Pair device from index %u failed: %s %d\n",
+			PTR_TO_UINT(user_data), mgmt_errstr(status), status);
+#endif
+		/* Kernel gave up itself, the node is out of reach. */
+		if (status == MGMT_STATUS_TIMED_OUT || status == MGMT_STATUS_CONN_FAILED) {
+			struct node *node = node_find(&ev->addr.bdaddr);
+
+			if (node)
+				node_timed_out(node, "pairing");
+		}
+
+		pairing_in_progress = false;
+		if (conn_pending)
+			scan_resume();
+		commission_next();
+		return;
+	}
+
+	DEBUG_PRINT("Pair device complete!\r\n");
+
+	if (connect_device(&ev->addr.bdaddr, ev->addr.type, true)) {
+		printf("Device %s connect ok!\n", bastr);
+		node_connected(&ev->addr.bdaddr);
+	} else {
+		printf("Device %s connect fail!\n", bastr);
+	}
+
+	pairing_in_progress = false;
+	commission_next();
+}
+
+
+/* Management API pair device. */
+static void pair_device(uint16_t index, const bdaddr_t *bdaddr, uint8_t addr_type)
+{
+	struct mgmt_cp_pair_device cp;
+
+#ifdef DEBUG_6LOWPAN
+	char bastr[20];
+
+	ba2str(bdaddr, bastr);
+	DEBUG_PRINT("Starting pairing with node: %s\n", bastr);
+#endif
+
+	memset(&cp, 0, sizeof(cp));
+	bacpy(&cp.addr.bdaddr, bdaddr);
+	cp.addr.type = addr_type;
+	cp.io_cap = 0x02;
+
+	TRACE_PROBE2(pair_start, bdaddr, cp.addr.type);
+
+	mgmt_send(mgmt, MGMT_OP_PAIR_DEVICE, index, sizeof(cp), &cp,
+		  pair_device_complete, UINT_TO_PTR(index), NULL);
+}
+
+
+static void start_6lowpan(void);
+
+
+/* Management API set powered complete event. */
+static void set_powered_complete(uint8_t status, uint16_t len,
+				 const void *param, void *user_data)
+{
+	uint16_t index = PTR_TO_UINT(user_data);
+	uint32_t settings;
+
+	if (status) {
+		fprintf(stderr, "Powering on for index %u failed: %s\n",
+						index, mgmt_errstr(status));
+		mainloop_quit();
+		return;
+	}
+
+	settings = get_le32(param);
+
+	if (!(settings & MGMT_SETTING_POWERED)) {
+		fprintf(stderr, "Controller is not powered\n");
+		mainloop_quit();
+		return;
+	}
+
+	mgmt_initialized = true;
+	start_6lowpan();
+}
+
+
+/* Management API read/set hci interface capabilities event. */
+static void read_info(uint8_t status, uint16_t len, const void *param,
+		      void *user_data)
+{
+	const struct mgmt_rp_read_info *rp = param;
+	uint16_t index = PTR_TO_UINT(user_data);
+	uint32_t supported_settings;
+	uint8_t val;
+
+	if (status) {
+		fprintf(stderr, "Reading info for index %u failed: %s\n",
+				index, mgmt_errstr(status));
+		mainloop_quit();
+		return;
+	}
+
+	supported_settings = le32_to_cpu(rp->supported_settings);
+
+	if (!(supported_settings & MGMT_SETTING_LE)) {
+		fprintf(stderr, "Low Energy support missing\n");
+		mainloop_quit();
+		return;
+	}
+
+	val = 0x00;
+	mgmt_send(mgmt, MGMT_OP_SET_POWERED, index, 1, &val,
+		  set_cfg_complete, "MGMT_OP_SET_POWERED", NULL);
+
+	val = 0x01;
+	mgmt_send(mgmt, MGMT_OP_SET_LE, index, 1, &val,
+		  set_cfg_complete, "MGMT_OP_SET_LE", NULL);
+
+	val = 0x02;
+	mgmt_send(mgmt, MGMT_OP_SET_IO_CAPABILITY, index, 1, &val,
+		  set_cfg_complete, "MGMT_OP_SET_IO_CAPABILITY", NULL);
+
+	if (auth_type != COMMISSIONING_AUTH_NONE) {
+		/* Bond with the nodes, so the keys can be reused on reconnection. */
+		val = 0x01;
+		mgmt_send(mgmt, MGMT_OP_SET_BONDABLE, index, 1, &val,
+			  set_cfg_complete, "MGMT_OP_SET_BONDABLE", NULL);
+
+		keys_upload(index);
+	}
+
+	val = 0x01;
+	mgmt_send(mgmt, MGMT_OP_SET_POWERED, index, 1, &val,
+		  set_powered_complete,	UINT_TO_PTR(index), NULL);
+}
+
+
+/* Initialize management API. */
+static void comm_auth_init(void)
+{
+	mgmt = mgmt_new_default();
+	if (!mgmt) {
+		fprintf(stderr, "Failed to open management socket\n");
+		exit(0);
+	}
+}
+
+
+/* Register management API events of the HCI device. */
+static void comm_auth_register(void)
+{
+	if (auth_type != COMMISSIONING_AUTH_NONE) {
+		/* Register user passkey request event. */
+		mgmt_register(mgmt, MGMT_EV_USER_PASSKEY_REQUEST, dev_id,
+			      passkey_request_event, UINT_TO_PTR(dev_id), NULL);
+
+		keys_register();
+	}
+}
+
+
+/* Configure management API to be able to pair devices. */
+static void comm_auth_configure(void)
+{
+	if (!mgmt_send(mgmt, MGMT_OP_READ_INFO, dev_id, 0, NULL,
+		       read_info, UINT_TO_PTR(dev_id), NULL)) {
+		fprintf(stderr, "Failed to read index list\n");
+		exit(0);
+	}
+}
+
+
+/* Pair device using passkey authentication. */
+static void comm_auth_pair(const bdaddr_t *bdaddr, uint8_t addr_type)
+{
+	char addr[DEVICE_ADDR_LEN];
+
+	ba2str(bdaddr, addr);
+	event_emit("pairing_started", "\"address\":\"%s\"", addr);
+
+	pairing_in_progress = true;
+	bacpy(&pairing_bdaddr, bdaddr);
+	pairing_addr_type = addr_type;
+	mainloop_modify_timeout(pair_timeout_id, PAIR_TIMEOUT);
+
+	pair_device(dev_id, bdaddr, addr_type);
+}
+
+
+/* Pairing took too long, cancel it and drop its link so the next candidate gets its turn. */
+static void pair_timeout(int id, void *user_data)
+{
+	struct mgmt_cp_disconnect cp;
+	struct node *node;
+
+	/* Pairing finished while the expiry was pending. */
+	if (!pairing_in_progress)
+		return;
+
+	memset(&cp, 0, sizeof(cp));
+	bacpy(&cp.addr.bdaddr, &pairing_bdaddr);
+	cp.addr.type = pairing_addr_type;
+
+	mgmt_send(mgmt, MGMT_OP_CANCEL_PAIR_DEVICE, dev_id, sizeof(cp.addr), &cp.addr,
+		  NULL, NULL, NULL);
+	mgmt_send(mgmt, MGMT_OP_DISCONNECT, dev_id, sizeof(cp), &cp, NULL, NULL, NULL);
+
+	node = node_find(&pairing_bdaddr);
+	if (node)
+		node_timed_out(node, "pairing");
+
+	pairing_in_progress = false;
+	if (conn_pending)
+		scan_resume();
+	commission_next();
+}
+
+
+/* Current time of the monotonic clock in milliseconds. */
+static uint64_t monotonic_ms(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (uint64_t) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+
+/* Arm a mainloop timeout to expire at the given monotonic time. */
+static void timeout_arm_at(int id, uint64_t deadline)
+{
+	uint64_t now = monotonic_ms();
+
+	/* Zero would leave the timer as it is, expire as soon as possible instead. */
+	mainloop_modify_timeout(id, deadline > now ? deadline - now : 1);
+}
+
+
+/*
+ * Stop a mainloop timeout, mainloop_modify_timeout() does not disarm with zero.
+ * Timeout ids are timerfds, removing one could free it under a pending event.
+ */
+static void timeout_disarm(int id)
+{
+	struct itimerspec its;
+
+	if (id < 0)
+		return;
+
+	memset(&its, 0, sizeof(its));
+	timerfd_settime(id, 0, &its, NULL);
+}
+
+
+/* Address type of HCI events in the form mgmt and 6lowpan_control use. */
+static uint8_t le_addr_type(uint8_t hci_type)
+{
+	return hci_type == LE_RANDOM_ADDRESS ? BDADDR_LE_RANDOM : BDADDR_LE_PUBLIC;
+}
+
+
+/* Find a node tracked by the connection scheduler. */
+static struct node *node_find(const bdaddr_t *bdaddr)
+{
+	unsigned int i;
+
+	for (i = 0; i < pools[POOL_NODES].size; i++) {
+		if (nodes[i].used && !bacmp(&nodes[i].bdaddr, bdaddr))
+			return &nodes[i];
+	}
+
+	return NULL;
+}
+
+
+/* Node is queued, pairing, connecting, connected or probed, its entry must not be reused. */
+static bool node_busy(const struct node *node)
+{
+	if (node->queued || node->connected || node->connect_deadline || node->probe_target)
+		return true;
+
+	return pairing_in_progress && !bacmp(&node->bdaddr, &pairing_bdaddr);
+}
+
+
+/*
+ * Track a node, reusing the least recently seen idle entry if the pool is full.
+ * Returns NULL if every entry is busy.
+ */
+static struct node *node_get(const bdaddr_t *bdaddr, uint8_t addr_type)
+{
+	struct node *node, *oldest = NULL;
+	unsigned int i;
+
+	node = node_find(bdaddr);
+	if (node)
+		return node;
+
+	for (i = 0; i < pools[POOL_NODES].size; i++) {
+		if (!nodes[i].used) {
+			oldest = &nodes[i];
+			nodes_used++;
+			break;
+		}
+
+		if (node_busy(&nodes[i]))
+			continue;
+
+		if (!oldest || nodes[i].last_seen < oldest->last_seen)
+			oldest = &nodes[i];
+	}
+
+	pool_set_used(POOL_NODES, nodes_used);
+
+	if (!oldest) {
+		DEBUG_PRINT("Node table full, %u nodes busy\n", pools[POOL_NODES].size);
+		return NULL;
+	}
+
+	memset(oldest, 0, sizeof(*oldest));
+	oldest->used = true;
+	bacpy(&oldest->bdaddr, bdaddr);
+	oldest->addr_type = addr_type;
+
+	return oldest;
+}
+
+
+/* Keep the SSID of the matched credential, the table may be rebuilt before pairing. */
+static void node_set_ssid(struct node *node, unsigned int cred)
+{
+	const struct auth_cred *c;
+
+	if (!cred) {
+		node->ssid_len = 0;
+		return;
+	}
+
+	c = &auth_creds[cred - 1];
+	node->ssid_len = c->ssid_len;
+	memcpy(node->ssid, c->ssid, c->ssid_len);
+}
+
+
+/* Record an advertising report of an IPSP candidate. */
+static void node_seen(const bdaddr_t *bdaddr, uint8_t addr_type, int8_t rssi,
+		      unsigned int cred)
+{
+	struct node *node;
+	uint64_t now = monotonic_ms();
+
+	node = node_get(bdaddr, addr_type);
+	if (!node)
+		return;
+
+	if (!node->last_seen)
+		node->rssi_avg = rssi * 16;
+	else
+		node->rssi_avg += (rssi * 16 - node->rssi_avg) / RSSI_SMOOTHING;
+
+	if (!node->waiting_since || now - node->last_seen > NODE_STALE_TIME) {
+		char addr[DEVICE_ADDR_LEN];
+
+		node->waiting_since = now;
+
+		ba2str(bdaddr, addr);
+		event_emit("discovered", "\"address\":\"%s\",\"rssi\":%d", addr, rssi);
+	}
+
+	node->addr_type = addr_type;
+	node_set_ssid(node, cred);
+	node->last_seen = now;
+	node->seen_cycle = scan_cycle_count;
+}
+
+
+/* Record a successful connection of a node. */
+static void node_connected(const bdaddr_t *bdaddr)
+{
+	struct node *node = node_find(bdaddr);
+
+	if (!node)
+		return;
+
+	node->successes++;
+	node->timeouts = 0;
+	node->retry_after = 0;
+}
+
+
+/* Operation on a node ran past its deadline, the node is retried later with a doubling delay. */
+static void node_timed_out(struct node *node, const char *op)
+{
+	char addr[DEVICE_ADDR_LEN];
+	unsigned int shift = node->timeouts < RETRY_SHIFT_MAX ? node->timeouts : RETRY_SHIFT_MAX;
+	unsigned int delay = RETRY_DELAY << shift;
+
+	node->timeouts++;
+	node->retry_after = monotonic_ms() + delay;
+
+	ba2str(&node->bdaddr, addr);
+	printf("Device %s %s timed out, retry in %u s\n", addr, op, delay / 1000);
+	event_emit("timeout", "\"address\":\"%s\",\"operation\":\"%s\",\"retry\":%u",
+		   addr, op, delay);
+}
+
+
+/* Arm the connect timer for the earliest deadline of the written connects. */
+static void connect_timeout_arm(void)
+{
+	uint64_t next = 0;
+	unsigned int i;
+
+	if (connect_timeout_id < 0)
+		return;
+
+	for (i = 0; i < pools[POOL_NODES].size; i++) {
+		uint64_t deadline = nodes[i].connect_deadline;
+
+		if (nodes[i].used && deadline && (!next || deadline < next))
+			next = deadline;
+	}
+
+	if (next)
+		timeout_arm_at(connect_timeout_id, next);
+	else
+		timeout_disarm(connect_timeout_id);
+}
+
+
+/* Connect written to the kernel, the link has to come up before the deadline. */
+static void connect_track(struct node *node)
+{
+	node->connect_deadline = monotonic_ms() + CONNECT_TIMEOUT;
+	connect_timeout_arm();
+}
+
+
+/* Link of a tracked connect is up. */
+static void connect_done(struct node *node)
+{
+	if (!node->connect_deadline)
+		return;
+
+	node->connect_deadline = 0;
+	node_connected(&node->bdaddr);
+	connect_timeout_arm();
+}
+
+
+/* Connects past their deadline are cancelled, unless the link was up already. */
+static void connect_timeout(int id, void *user_data)
+{
+	struct hci_conn_list_req *cl = read_conn_list(dev_id);
+	uint64_t now = monotonic_ms();
+	unsigned int i;
+	int j;
+
+	for (i = 0; i < pools[POOL_NODES].size; i++) {
+		struct node *node = &nodes[i];
+
+		if (!node->used || !node->connect_deadline || node->connect_deadline > now)
+			continue;
+
+		node->connect_deadline = 0;
+
+		/* Reconnection over a link which stayed up, no LE Connection Complete. */
+		for (j = 0; cl && j < cl->conn_num; j++) {
+			if (!bacmp(&cl->conn_info[j].bdaddr, &node->bdaddr))
+				break;
+		}
+
+		if (cl && j < cl->conn_num) {
+			node_connected(&node->bdaddr);
+			continue;
+		}
+
+		/* Controller gives up the pending LE Create Connection, the kernel its channel. */
+		hci_send_cmd(hci_dd, OGF_LE_CTL, OCF_LE_CREATE_CONN_CANCEL, 0, NULL);
+		connect_device(&node->bdaddr, node->addr_type, false);
+
+		node_timed_out(node, "connect");
+	}
+
+	connect_timeout_arm();
+}
+
+
+/* Rank candidate by smoothed RSSI, prior success rate and time waiting. */
+static int node_score(const struct node *node, uint64_t now)
+{
+	int score;
+
+	score = node->rssi_avg / 16;
+	score += SCORE_SUCCESS_WEIGHT * (node->successes + 1) / (node->attempts + 2);
+	score += SCORE_AGING * (int) ((now - node->waiting_since) / 1000);
+
+	return score;
+}
+
+
+/* Pair or connect an IPSP device accepted by scanning or discovery. */
+static void commission_device(const bdaddr_t *bdaddr, uint8_t addr_type)
+{
+	char bastr[DEVICE_ADDR_LEN];
+	struct node *node;
+
+	if (current_conn_num(dev_id) >= MAX_BLE_CONN)
+		return;
+
+	ba2str(bdaddr, bastr);
+
+	if (auth_type != COMMISSIONING_AUTH_NONE && !keys_known(bdaddr, addr_type)) {
+		if (pairing_in_progress)
+			return;
+
+		DEBUG_PRINT("Pairing with device %s\r\n", bastr);
+
+		scan_pause();
+		comm_auth_pair(bdaddr, addr_type);
+	} else {
+		scan_pause();
+
+		if (connect_device(bdaddr, addr_type, true)) {
+			printf("Device %s connect ok!\n", bastr);
+			node = node_get(bdaddr, addr_type);
+			if (node)
+				connect_track(node);
+		} else {
+			printf("Device %s connect fail!\n", bastr);
+			scan_resume();
+		}
+	}
+}
+
+
+/* Queue an admitted candidate, the queue holds at most one per connection slot. */
+static bool admit_push(struct node *node)
+{
+	if (node->queued || admit_len == MAX_BLE_CONN)
+		return false;
+
+	admit_queue[(admit_head + admit_len) % MAX_BLE_CONN] = node;
+	admit_len++;
+	node->queued = true;
+
+	return true;
+}
+
+
+/* Commission admitted candidates, one pairing at a time. */
+static void commission_next(void)
+{
+	struct node *node;
+
+	while (admit_len && !pairing_in_progress) {
+		node = admit_queue[admit_head];
+		admit_head = (admit_head + 1) % MAX_BLE_CONN;
+		admit_len--;
+
+		node->queued = false;
+		node->attempts++;
+		node->waiting_since = 0;
+
+		commission_device(&node->bdaddr, node->addr_type);
+	}
+}
+
+
+/* Admit the best ranked candidates of last scanning cycle into free slots. */
+static unsigned int scheduler_admit(void)
+{
+	uint64_t now = monotonic_ms();
+	int conn_num, free_slots;
+	unsigned int i, admitted = 0;
+
+	conn_num = current_conn_num(dev_id);
+	if (conn_num < 0)
+		return 0;
+
+	/* Candidates still queued from earlier cycles hold their slots. */
+	free_slots = MAX_BLE_CONN - conn_num - admit_len;
+
+	/* Selection of the few best candidates, pool is small. */
+	while ((int) admitted < free_slots) {
+		struct node *best = NULL;
+		int best_score = 0;
+
+		for (i = 0; i < pools[POOL_NODES].size; i++) {
+			struct node *node = &nodes[i];
+			int score;
+
+			if (!node->used || node->queued ||
+			    node->seen_cycle != scan_cycle_count ||
+			    !node->waiting_since || node->retry_after > now)
+				continue;
+
+			score = node_score(node, now);
+			if (!best || score > best_score) {
+				best = node;
+				best_score = score;
+			}
+		}
+
+		if (!best || !admit_push(best))
+			break;
+
+		DEBUG_PRINT("Admitting candidate with score %d\n", best_score);
+
+		admitted++;
+	}
+
+	commission_next();
+
+	return admitted;
+}
+
+
+/* Delay between two scanning cycles, stretched while idle or full. */
+static unsigned int scan_delay(void)
+{
+	return scanning_interval * scan_backoff;
+}
+
+
+/* Double the delay after a cycle without candidates or free slots, reset it otherwise. */
+static void scan_backoff_update(bool active)
+{
+	if (active)
+		scan_backoff = 1;
+	else if (scan_backoff * 2 <= scan_backoff_max)
+		scan_backoff *= 2;
+	else
+		scan_backoff = scan_backoff_max;
+
+	DEBUG_PRINT("Next scanning cycle in %u ms\n", scan_delay());
+}
+
+
+/* Request the connection parameters of the node's profile on a new link. */
+static void conn_profile_apply(struct node *node)
+{
+	const struct conn_profile *cp;
+	le_connection_update_cp cmd;
+
+	node->profile = conn_profile_of(&node->bdaddr);
+
+	cp = &conn_profiles[node->profile];
+	if (!cp->max_interval)
+		return;
+
+	memset(&cmd, 0, sizeof(cmd));
+	cmd.handle = htobs(node->handle);
+	cmd.min_interval = htobs(cp->min_interval);
+	cmd.max_interval = htobs(cp->max_interval);
+	cmd.latency = htobs(cp->latency);
+	cmd.supervision_timeout = htobs(cp->timeout);
+	cmd.min_ce_length = htobs(0x0001);
+	cmd.max_ce_length = htobs(0x0001);
+
+	/* Outcome arrives as LE Connection Update Complete, the peer may reject it. */
+	if (hci_send_cmd(hci_dd, OGF_LE_CTL, OCF_LE_CONN_UPDATE,
+			 LE_CONN_UPDATE_CP_SIZE, &cmd) < 0)
+		perror("Connection update failed");
+}
+
+
+/* Read Data Length Extension and 2M PHY support of the controller. */
+static void link_features_init(void)
+{
+	le_read_local_supported_features_rp rp;
+	le_read_supported_states_rp states;
+	struct hci_request rq;
+
+	memset(&rq, 0, sizeof(rq));
+	rq.ogf = OGF_LE_CTL;
+	rq.ocf = OCF_LE_READ_LOCAL_SUPPORTED_FEATURES;
+	rq.rparam = &rp;
+	rq.rlen = sizeof(rp);
+
+	if (hci_send_req(hci_dd, &rq, 1000) < 0 || rp.status) {
+		le_features = 0;
+		return;
+	}
+
+	le_features = rp.features[0] | (rp.features[1] << 8);
+
+	memset(&rq, 0, sizeof(rq));
+	rq.ogf = OGF_LE_CTL;
+	rq.ocf = OCF_LE_READ_SUPPORTED_STATES;
+	rq.rparam = &states;
+	rq.rlen = sizeof(states);
+
+	if (hci_send_req(hci_dd, &rq, 1000) == 0 && !states.status)
+		scan_concurrent = (btohll(states.states) & LE_STATE_SCAN_INITIATING) &&
+				  (btohll(states.states) & LE_STATE_SCAN_MASTER);
+
+	DEBUG_PRINT("Controller Data Length Extension %s, 2M PHY %s, scanning while initiating %s\n",
+		    le_features & LE_FEATURE_DATA_LENGTH ? "yes" : "no",
+		    le_features & LE_FEATURE_2M_PHY ? "yes" : "no",
+		    scan_concurrent ? "yes" : "no");
+}
+
+
+/* Ask for the largest LL payload, the result arrives as Data Length Change. */
+static void link_set_data_length(struct node *node)
+{
+	struct link_set_data_length_cp cp;
+
+	if (!(le_features & LE_FEATURE_DATA_LENGTH))
+		return;
+
+	cp.handle = htobs(node->handle);
+	cp.tx_octets = htobs(LINK_MAX_TX_OCTETS);
+	cp.tx_time = htobs(LINK_MAX_TX_TIME);
+
+	/* Refusal comes back as Command Complete, handled in hci_cmd_complete(). */
+	if (hci_send_cmd(hci_dd, OGF_LE_CTL, OCF_LE_SET_DATA_LENGTH,
+			 sizeof(cp), &cp) < 0)
+		perror("Set data length failed");
+}
+
+
+/* Prefer the 2M PHY, the result arrives as PHY Update Complete. */
+static void link_set_phy(struct node *node)
+{
+	struct link_set_phy_cp cp;
+
+	if (!(le_features & LE_FEATURE_2M_PHY))
+		return;
+
+	cp.handle = htobs(node->handle);
+	cp.all_phys = 0x00;
+	cp.tx_phys = LE_PHY_2M;
+	cp.rx_phys = LE_PHY_2M;
+	cp.phy_options = 0;
+
+	/* Refusal comes back as Command Status, handled in hci_cmd_status(). */
+	if (hci_send_cmd(hci_dd, OGF_LE_CTL, OCF_LE_SET_PHY, sizeof(cp), &cp) < 0)
+		perror("Set PHY failed");
+}
+
+
+/* Node owning a connection handle. */
+static struct node *node_find_handle(uint16_t handle)
+{
+	unsigned int i;
+
+	for (i = 0; i < pools[POOL_NODES].size; i++) {
+		if (nodes[i].used && nodes[i].handle == handle)
+			return &nodes[i];
+	}
+
+	return NULL;
+}
+
+
+static void direct_link_up(const bdaddr_t *bdaddr);
+
+
+/* New LE connection, negotiate parameters, Data Length and PHY. */
+static void link_setup(const bdaddr_t *bdaddr, uint8_t addr_type, uint16_t handle)
+{
+	struct node *node;
+	char addr[DEVICE_ADDR_LEN];
+
+	/* Handles are reused, drop the one of an earlier link. */
+	node = node_find_handle(handle);
+	if (node)
+		node->handle = 0;
+
+	/* Untracked link keeps the parameters the controller chose. */
+	node = node_get(bdaddr, addr_type);
+	if (node) {
+		node->addr_type = addr_type;
+		node->handle = handle;
+		node->connected = true;
+		connect_done(node);
+		node->tx_octets = node->rx_octets = LINK_DEFAULT_OCTETS;
+		node->tx_phy = node->rx_phy = LE_PHY_1M;
+
+		conn_profile_apply(node);
+		link_set_data_length(node);
+		link_set_phy(node);
+	}
+
+	ba2str(bdaddr, addr);
+	event_emit("connected", "\"address\":\"%s\",\"handle\":%u", addr, handle);
+
+	direct_link_up(bdaddr);
+}
+
+
+/* Link lost or closed, reason is the HCI error code. */
+static void link_disconnected(const evt_disconn_complete *evt)
+{
+	struct node *node;
+	char addr[DEVICE_ADDR_LEN];
+
+	if (evt->status)
+		return;
+
+	/* Slot is free, look for candidates right away. */
+	scheduler_kick();
+
+	node = node_find_handle(btohs(evt->handle));
+	if (!node)
+		return;
+
+	node->connected = false;
+
+	ba2str(&node->bdaddr, addr);
+	event_emit("disconnected", "\"address\":\"%s\",\"reason\":%u", addr,
+		   evt->reason);
+}
+
+
+/* Parameters of a link changed, or the update requested on link setup failed. */
+static void link_conn_updated(const evt_le_connection_update_complete *evt)
+{
+	struct node *node = node_find_handle(btohs(evt->handle));
+	char addr[DEVICE_ADDR_LEN];
+
+	if (!node)
+		return;
+
+	ba2str(&node->bdaddr, addr);
+
+	/* Link then keeps the parameters it has. */
+	if (evt->status) {
+		fprintf(stderr, "Device %s %s parameters failed: 0x%02x\n", addr,
+			conn_profiles[node->profile].name, evt->status);
+		return;
+	}
+
+	DEBUG_PRINT("Device %s interval %u latency %u timeout %u\n", addr,
+		    btohs(evt->interval), btohs(evt->latency),
+		    btohs(evt->supervision_timeout));
+}
+
+
+/* Controller reports the LL payload both sides agreed on. */
+static void link_data_length_changed(const struct link_data_length_change_evt *evt)
+{
+	struct node *node = node_find_handle(btohs(evt->handle));
+
+	if (!node)
+		return;
+
+	node->tx_octets = btohs(evt->max_tx_octets);
+	node->rx_octets = btohs(evt->max_rx_octets);
+}
+
+
+/* Controller reports the PHY of the link, unchanged if the peer lacks 2M. */
+static void link_phy_updated(const struct link_phy_update_evt *evt)
+{
+	struct node *node = node_find_handle(btohs(evt->handle));
+
+	if (!node || evt->status)
+		return;
+
+	node->tx_phy = evt->tx_phy;
+	node->rx_phy = evt->rx_phy;
+}
+
+
+/* Sample RSSI and channel map of a connected node, results arrive as Command Complete. */
+static void link_sample(struct node *node, uint16_t handle)
+{
+	read_rssi_cp rssi_cp;
+	le_read_channel_map_cp map_cp;
+
+	node->connected = true;
+
+	/* Link established before startup, negotiated values are unknown. */
+	if (node->handle != handle) {
+		node->handle = handle;
+		node->tx_octets = node->rx_octets = 0;
+		node->tx_phy = node->rx_phy = 0;
+	}
+
+	rssi_cp.handle = htobs(handle);
+	if (hci_send_cmd(hci_dd, OGF_STATUS_PARAM, OCF_READ_RSSI,
+			 READ_RSSI_CP_SIZE, &rssi_cp) < 0)
+		return;
+
+	map_cp.handle = htobs(handle);
+	hci_send_cmd(hci_dd, OGF_LE_CTL, OCF_LE_READ_CHANNEL_MAP,
+		     LE_READ_CHANNEL_MAP_CP_SIZE, &map_cp);
+}
+
+
+/* RSSI of a link was read, recycle the link if it stays below the threshold. */
+static void link_rssi_read(const read_rssi_rp *rp)
+{
+	struct node *node = node_find_handle(btohs(rp->handle));
+	char addr[DEVICE_ADDR_LEN];
+
+	if (!node || rp->status)
+		return;
+
+	node->link_rssi[node->link_samples % LINK_HISTORY] = rp->rssi;
+	node->link_samples++;
+
+	if (link_rssi_threshold == LINK_RSSI_NONE || rp->rssi >= link_rssi_threshold) {
+		node->link_low = 0;
+		return;
+	}
+
+	if (++node->link_low < LINK_RECYCLE_SAMPLES)
+		return;
+
+	/* Link stays degraded, free the slot so the scheduler can reconnect. */
+	ba2str(&node->bdaddr, addr);
+	printf("Device %s link degraded (%d dBm), recycling\n", addr, rp->rssi);
+
+	node->link_low = 0;
+	node->link_recycles++;
+	connect_device(&node->bdaddr, node->addr_type, false);
+}
+
+
+/* Channel map of a link was read, count the data channels in use. */
+static void link_channel_map_read(const le_read_channel_map_rp *rp)
+{
+	struct node *node = node_find_handle(btohs(rp->handle));
+	unsigned int i, count = 0;
+
+	if (!node || rp->status)
+		return;
+
+	/* 37 data channels, one bit each. */
+	for (i = 0; i < 37; i++) {
+		if (rp->map[i / 8] & (1 << (i % 8)))
+			count++;
+	}
+
+	node->link_channels = count;
+}
+
+
+/* Name of an LE PHY, as shown by lscon. */
+static const char *phy_name(uint8_t phy)
+{
+	switch (phy) {
+	case LE_PHY_1M:
+		return "1M";
+	case LE_PHY_2M:
+		return "2M";
+	case LE_PHY_CODED:
+		return "coded";
+	}
+
+	return "-";
+}
+
+
+/* Check if the connection list has a link to the address. */
+static bool conn_list_has(const struct hci_conn_list_req *cl, const bdaddr_t *bdaddr)
+{
+	int i;
+
+	for (i = 0; cl && i < cl->conn_num; i++) {
+		if (!bacmp(&cl->conn_info[i].bdaddr, bdaddr))
+			return true;
+	}
+
+	return false;
+}
+
+
+/* Format the link quality line of a node, nothing if it was neither sampled nor probed. */
+static int link_state_line(const struct node *node, char *buf, int size)
+{
+	char addr[DEVICE_ADDR_LEN];
+	int rssi_min = 0, rssi_max = 0, rssi_sum = 0, len = 0;
+	unsigned int j, n, lost;
+
+	if (!node->link_samples && !node->probe_sent)
+		return 0;
+
+	ba2str(&node->bdaddr, addr);
+	len += snprintf(buf + len, size - len, "%s", addr);
+
+	if (node->link_samples) {
+		n = node->link_samples < LINK_HISTORY ? node->link_samples : LINK_HISTORY;
+		for (j = 0; j < n; j++) {
+			int rssi = node->link_rssi[j];
+
+			if (!j || rssi < rssi_min)
+				rssi_min = rssi;
+			if (!j || rssi > rssi_max)
+				rssi_max = rssi;
+			rssi_sum += rssi;
+		}
+
+		len += snprintf(buf + len, size - len,
+				" rssi %d min %d max %d channels %u recycles %u profile %s"
+				" octets %u/%u phy %s/%s",
+				rssi_sum / (int) n, rssi_min, rssi_max,
+				node->link_channels, node->link_recycles,
+				conn_profiles[node->profile].name,
+				node->tx_octets, node->rx_octets,
+				phy_name(node->tx_phy), phy_name(node->rx_phy));
+	}
+
+	if (node->probe_sent) {
+		/* Echo still in flight is not counted as lost yet. */
+		lost = node->probe_sent - node->probe_received -
+		       (node->probe_pending ? 1 : 0);
+		len += snprintf(buf + len, size - len,
+				" rtt %u loss %u%%", node->rtt_avg,
+				lost * 100 / node->probe_sent);
+	}
+
+	len += snprintf(buf + len, size - len, "\n");
+
+	return len;
+}
+
+
+/* Write link quality of connected nodes and probe targets for the lscon command. */
+static void link_state_write(struct hci_conn_list_req *cl)
+{
+	char buf[256 * (MAX_BLE_CONN + MAX_PROBE_TARGETS)];
+	struct node *node;
+	int len = 0, fd, i;
+
+	for (i = 0; cl && i < cl->conn_num; i++) {
+		node = node_find(&cl->conn_info[i].bdaddr);
+		if (node)
+			len += link_state_line(node, buf + len, sizeof(buf) - len);
+	}
+
+	for (i = 0; i < (int) probe_target_count; i++) {
+		node = node_find(&probe_targets[i]);
+		if (node && !conn_list_has(cl, &probe_targets[i]))
+			len += link_state_line(node, buf + len, sizeof(buf) - len);
+	}
+
+	fd = open(LINK_STATE_PATH, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0)
+		return;
+
+	if (write(fd, buf, len) != len)
+		perror("Write link state failed");
+
+	close(fd);
+}
+
+
+/* Periodic link quality sampling of all LE connections, the state shows the last results. */
+static void link_timeout(int id, void *user_data)
+{
+	struct hci_conn_list_req *cl;
+	int i;
+
+	mainloop_modify_timeout(id, link_interval);
+
+	cl = read_conn_list(dev_id);
+	if (!cl)
+		return;
+
+	for (i = 0; i < cl->conn_num; i++) {
+		struct hci_conn_info *ci = &cl->conn_info[i];
+		struct node *node;
+
+		if (ci->type != LE_LINK)
+			continue;
+
+		/* Creating the node would guess its address type and could evict a candidate. */
+		node = node_find(&ci->bdaddr);
+		if (node)
+			link_sample(node, ci->handle);
+	}
+
+	link_state_write(cl);
+}
+
+
+/* Link-local address of a node, its IID is derived from the BD address (RFC 7668). */
+static void probe_node_addr(const struct node *node, struct in6_addr *addr)
+{
+	const uint8_t *b = node->bdaddr.b;
+
+	memset(addr, 0, sizeof(*addr));
+	addr->s6_addr[0] = 0xfe;
+	addr->s6_addr[1] = 0x80;
+	addr->s6_addr[8] = b[5];
+	addr->s6_addr[9] = b[4];
+	addr->s6_addr[10] = b[3];
+	addr->s6_addr[11] = 0xff;
+	addr->s6_addr[12] = 0xfe;
+	addr->s6_addr[13] = b[2];
+	addr->s6_addr[14] = b[1];
+	addr->s6_addr[15] = b[0];
+
+	/* Universal/local bit is set for random addresses only. */
+	if (node->addr_type == BDADDR_LE_PUBLIC)
+		addr->s6_addr[8] &= ~0x02;
+	else
+		addr->s6_addr[8] |= 0x02;
+}
+
+
+/* Send one echo request, the sequence number is the index of the node. */
+static void probe_send(struct node *node)
+{
+	struct sockaddr_in6 dst;
+	struct icmp6_hdr hdr;
+	uint64_t now = monotonic_ms();
+	uint8_t buf[sizeof(hdr) + sizeof(now)];
+
+	memset(&dst, 0, sizeof(dst));
+	dst.sin6_family = AF_INET6;
+	dst.sin6_scope_id = probe_ifindex;
+	probe_node_addr(node, &dst.sin6_addr);
+
+	/* Checksum of ICMPv6 raw sockets is filled in by the kernel. */
+	memset(&hdr, 0, sizeof(hdr));
+	hdr.icmp6_type = ICMP6_ECHO_REQUEST;
+	hdr.icmp6_id = htons(probe_ident);
+	hdr.icmp6_seq = htons(node - nodes);
+	memcpy(buf, &hdr, sizeof(hdr));
+	memcpy(buf + sizeof(hdr), &now, sizeof(now));
+
+	if (sendto(probe_fd, buf, sizeof(buf), 0, (struct sockaddr *) &dst,
+		   sizeof(dst)) < 0) {
+		DEBUG_PRINT("Echo request failed: %s\n", strerror(errno));
+		return;
+	}
+
+	node->probe_pending = true;
+	node->probe_sent_at = now;
+	node->probe_sent++;
+}
+
+
+/* Echo reply received on the 6LoWPAN interface. */
+static void probe_event(int fd, uint32_t events, void *user_data)
+{
+	struct sockaddr_in6 src;
+	socklen_t srclen = sizeof(src);
+	struct icmp6_hdr hdr;
+	struct in6_addr addr;
+	struct node *node;
+	uint8_t buf[sizeof(hdr) + sizeof(uint64_t)];
+	unsigned int seq, rtt;
+	ssize_t len;
+
+	len = recvfrom(fd, buf, sizeof(buf), 0, (struct sockaddr *) &src, &srclen);
+	if (len < (ssize_t) sizeof(buf))
+		return;
+
+	memcpy(&hdr, buf, sizeof(hdr));
+	seq = ntohs(hdr.icmp6_seq);
+
+	if (hdr.icmp6_type != ICMP6_ECHO_REPLY ||
+	    ntohs(hdr.icmp6_id) != probe_ident || seq >= pools[POOL_NODES].size)
+		return;
+
+	node = &nodes[seq];
+	if (!node->used || !node->probe_pending)
+		return;
+
+	/* Slot may have been reused by another node since the request. */
+	probe_node_addr(node, &addr);
+	if (memcmp(&addr, &src.sin6_addr, sizeof(addr)))
+		return;
+
+	rtt = monotonic_ms() - node->probe_sent_at;
+	if (node->probe_received)
+		node->rtt_avg += ((int) rtt - (int) node->rtt_avg) / (1 << PROBE_RTT_SMOOTHING);
+	else
+		node->rtt_avg = rtt;
+
+	node->probe_pending = false;
+	node->probe_received++;
+	node->probe_lost = 0;
+}
+
+
+/* Send the next echo to a node, false if too many echoes in a row were lost. */
+static bool probe_node(struct node *node)
+{
+	char addr[DEVICE_ADDR_LEN];
+
+	if (node->probe_pending && ++node->probe_lost >= PROBE_LOSS_LIMIT) {
+		ba2str(&node->bdaddr, addr);
+		printf("Device %s unreachable over %s\n", addr, lowpan_iface);
+
+		node->probe_pending = false;
+		node->probe_lost = 0;
+		return false;
+	}
+
+	probe_send(node);
+	return true;
+}
+
+
+/* Periodic echo of all connected nodes and targets, sustained loss recycles the link. */
+static void probe_timeout(int id, void *user_data)
+{
+	struct hci_conn_list_req *cl;
+	struct node *node;
+	int i;
+
+	mainloop_modify_timeout(id, probe_interval);
+
+	/* Interface is recreated with the first link, look it up every time. */
+	probe_ifindex = if_nametoindex(lowpan_iface);
+	if (!probe_ifindex)
+		return;
+
+	cl = read_conn_list(dev_id);
+
+	for (i = 0; cl && i < cl->conn_num; i++) {
+		if (cl->conn_info[i].type != LE_LINK)
+			continue;
+
+		/* Links of nodes the scheduler does not know are not probed. */
+		node = node_find(&cl->conn_info[i].bdaddr);
+		if (!node)
+			continue;
+
+		if (!probe_node(node)) {
+			node->link_recycles++;
+			connect_device(&node->bdaddr, node->addr_type, false);
+		}
+	}
+
+	/* Targets without a link are probed as well, e.g. on a stand-in interface. */
+	for (i = 0; i < (int) probe_target_count; i++) {
+		if (conn_list_has(cl, &probe_targets[i]))
+			continue;
+
+		node = node_get(&probe_targets[i], BDADDR_LE_PUBLIC);
+		if (!node)
+			continue;
+
+		node->probe_target = true;
+		probe_node(node);
+	}
+
+	link_state_write(cl);
+}
+
+
+/* Open the ICMPv6 socket of the prober, only echo replies are received. */
+static void probe_init(void)
+{
+	struct icmp6_filter filter;
+
+	probe_fd = socket(AF_INET6, SOCK_RAW | SOCK_NONBLOCK | SOCK_CLOEXEC,
+			  IPPROTO_ICMPV6);
+	if (probe_fd < 0) {
+		perror("Could not open ICMPv6 socket");
+		return;
+	}
+
+	ICMP6_FILTER_SETBLOCKALL(&filter);
+	ICMP6_FILTER_SETPASS(ICMP6_ECHO_REPLY, &filter);
+	if (setsockopt(probe_fd, IPPROTO_ICMPV6, ICMP6_FILTER, &filter,
+		       sizeof(filter)) < 0)
+		perror("Could not set ICMPv6 filter");
+
+	probe_ident = getpid() & 0xffff;
+
+	mainloop_add_fd(probe_fd, EPOLLIN, probe_event, NULL, NULL);
+	probe_timeout_id = mainloop_add_timeout(probe_interval, probe_timeout,
+						NULL, NULL);
+}
+
+
+/* Run the interface hook, e.g. to let netifd know, without waiting for it. */
+static void netif_hook(const char *state)
+{
+	pid_t pid;
+
+	if (!lowpan_hook)
+		return;
+
+	pid = fork();
+	if (pid < 0) {
+		perror("Could not run interface hook");
+		return;
+	}
+
+	if (pid == 0) {
+		execl(lowpan_hook, lowpan_hook, lowpan_iface, state, (char *) NULL);
+		_exit(127);
+	}
+}
+
+
+/* Add an IPv6 address to the interface, an existing address is replaced. */
+static void netif_add_addr(int index, const struct in6_addr *addr,
+			   unsigned char prefixlen)
+{
+	struct {
+		struct nlmsghdr	 nh;
+		struct ifaddrmsg ifa;
+		char		 attr[RTA_SPACE(sizeof(struct in6_addr))];
+	} req;
+	struct sockaddr_nl kernel;
+	struct rtattr *rta;
+
+	memset(&req, 0, sizeof(req));
+	req.nh.nlmsg_len = NLMSG_LENGTH(sizeof(req.ifa));
+	req.nh.nlmsg_type = RTM_NEWADDR;
+	req.nh.nlmsg_flags = NLM_F_REQUEST | NLM_F_CREATE | NLM_F_REPLACE;
+	req.ifa.ifa_family = AF_INET6;
+	req.ifa.ifa_prefixlen = prefixlen;
+	req.ifa.ifa_index = index;
+	req.ifa.ifa_scope = IN6_IS_ADDR_LINKLOCAL(addr) ? RT_SCOPE_LINK :
+							  RT_SCOPE_UNIVERSE;
+
+	rta = (struct rtattr *) ((char *) &req + NLMSG_ALIGN(req.nh.nlmsg_len));
+	rta->rta_type = IFA_ADDRESS;
+	rta->rta_len = RTA_LENGTH(sizeof(*addr));
+	memcpy(RTA_DATA(rta), addr, sizeof(*addr));
+	req.nh.nlmsg_len = NLMSG_ALIGN(req.nh.nlmsg_len) + rta->rta_len;
+
+	memset(&kernel, 0, sizeof(kernel));
+	kernel.nl_family = AF_NETLINK;
+
+	/* Failures come back as NLMSG_ERROR on the monitor socket. */
+	if (sendto(netif_fd, &req, req.nh.nlmsg_len, 0, (struct sockaddr *) &kernel,
+		   sizeof(kernel)) < 0)
+		perror("Could not restore interface address");
+}
+
+
+/*
+ * Bring a new interface instance up and restore its addresses. An instance the
+ * operator took down stays down, its addresses come back when it is up again.
+ */
+static void netif_restore(int index, unsigned int flags)
+{
+	struct ifreq ifr;
+	unsigned int i;
+	int fd;
+
+	/* Kernel recreated the interface with the first link, it starts down. */
+	if (index != netif_index) {
+		netif_index = index;
+		netif_up = false;
+
+		if (!(flags & IFF_UP)) {
+			fd = socket(AF_INET6, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+			if (fd < 0)
+				return;
+
+			memset(&ifr, 0, sizeof(ifr));
+			strncpy(ifr.ifr_name, lowpan_iface, IFNAMSIZ - 1);
+			ifr.ifr_flags = flags | IFF_UP;
+
+			if (ioctl(fd, SIOCSIFFLAGS, &ifr) < 0) {
+				perror("Could not bring interface up");
+				close(fd);
+				return;
+			}
+
+			close(fd);
+			printf("Interface %s brought up\n", lowpan_iface);
+			flags |= IFF_UP;
+		}
+	}
+
+	/* Addresses are flushed when an interface goes down. */
+	if (!(flags & IFF_UP)) {
+		netif_up = false;
+		return;
+	}
+
+	if (netif_up)
+		return;
+
+	netif_up = true;
+
+	for (i = 0; i < netif_addr_count; i++)
+		netif_add_addr(index, &netif_addrs[i].addr, netif_addrs[i].prefixlen);
+
+	netif_hook("up");
+	event_emit("interface", "\"name\":\"%s\",\"state\":\"up\"", lowpan_iface);
+}
+
+
+/* Restore the interface if it exists, called after a link is established too. */
+static void netif_check(void)
+{
+	struct ifreq ifr;
+	int index, fd;
+
+	if (netif_fd < 0)
+		return;
+
+	index = if_nametoindex(lowpan_iface);
+	if (!index)
+		return;
+
+	fd = socket(AF_INET6, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+	if (fd < 0)
+		return;
+
+	memset(&ifr, 0, sizeof(ifr));
+	strncpy(ifr.ifr_name, lowpan_iface, IFNAMSIZ - 1);
+
+	if (ioctl(fd, SIOCGIFFLAGS, &ifr) == 0)
+		netif_restore(index, ifr.ifr_flags);
+
+	close(fd);
+}
+
+
+/* rtnetlink link notification, the kernel recreates the interface with the first link. */
+static void netif_event(int fd, uint32_t events, void *user_data)
+{
+	static char buf[8192] __attribute__ ((aligned(NLMSG_ALIGNTO)));
+	struct nlmsghdr *nh;
+	ssize_t len;
+
+	len = recv(fd, buf, sizeof(buf), 0);
+	if (len <= 0)
+		return;
+
+	for (nh = (struct nlmsghdr *) buf; NLMSG_OK(nh, (size_t) len);
+	     nh = NLMSG_NEXT(nh, len)) {
+		struct ifinfomsg *ifi = NLMSG_DATA(nh);
+		struct rtattr *rta;
+		const char *name = NULL;
+		int rlen;
+
+		if (nh->nlmsg_type == NLMSG_ERROR) {
+			struct nlmsgerr *err = NLMSG_DATA(nh);
+
+			if (err->error)
+				fprintf(stderr, "Interface restore failed: %s\n",
+					strerror(-err->error));
+			continue;
+		}
+
+		if (nh->nlmsg_type != RTM_NEWLINK && nh->nlmsg_type != RTM_DELLINK)
+			continue;
+
+		rlen = IFLA_PAYLOAD(nh);
+		for (rta = IFLA_RTA(ifi); RTA_OK(rta, rlen); rta = RTA_NEXT(rta, rlen)) {
+			if (rta->rta_type == IFLA_IFNAME)
+				name = RTA_DATA(rta);
+		}
+
+		if (!name || strcmp(name, lowpan_iface))
+			continue;
+
+		if (nh->nlmsg_type == RTM_DELLINK) {
+			netif_index = 0;
+			netif_up = false;
+			netif_hook("down");
+			event_emit("interface", "\"name\":\"%s\",\"state\":\"down\"",
+				   lowpan_iface);
+			continue;
+		}
+
+		netif_restore(ifi->ifi_index, ifi->ifi_flags);
+	}
+}
+
+
+/* Monitor the 6LoWPAN interface through rtnetlink. */
+static void netif_init(void)
+{
+	struct sockaddr_nl addr;
+
+	netif_fd = socket(AF_NETLINK, SOCK_RAW | SOCK_NONBLOCK | SOCK_CLOEXEC,
+			  NETLINK_ROUTE);
+	if (netif_fd < 0) {
+		perror("Could not open rtnetlink socket");
+		return;
+	}
+
+	memset(&addr, 0, sizeof(addr));
+	addr.nl_family = AF_NETLINK;
+	addr.nl_groups = RTMGRP_LINK;
+
+	if (bind(netif_fd, (struct sockaddr *) &addr, sizeof(addr)) < 0) {
+		perror("Could not bind rtnetlink socket");
+		close(netif_fd);
+		netif_fd = -1;
+		return;
+	}
+
+	mainloop_add_fd(netif_fd, EPOLLIN, netif_event, NULL, NULL);
+
+	/* Interface may be there already, with links from before startup. */
+	netif_check();
+}
+
+
+/* Set LE scanning without waiting for completion, the event loop may be dispatching. */
+static int scan_set_enable(uint8_t enable)
+{
+	le_set_scan_enable_cp cp;
+
+	cp.enable = enable;
+	cp.filter_dup = 0x01;
+
+	if (hci_send_cmd(hci_dd, OGF_LE_CTL, OCF_LE_SET_SCAN_ENABLE,
+			 LE_SET_SCAN_ENABLE_CP_SIZE, &cp) < 0) {
+		perror("Set scan enable failed");
+		return -1;
+	}
+
+	return 0;
+}
+
+
+/* Enable LE scanning for one scanning window. */
+static void scan_start(void)
+{
+	le_set_scan_parameters_cp cp;
+
+	/* Active scanning from the public address, no filter policy. */
+	memset(&cp, 0, sizeof(cp));
+	cp.type = 0x01;
+	cp.interval = htobs(le_scan_interval);
+	cp.window = htobs(le_scan_window);
+	cp.own_bdaddr_type = LE_PUBLIC_ADDRESS;
+	cp.filter = 0x00;
+
+	/* Scan BLE devices, the controller runs commands in the order they are sent. */
+	if (hci_send_cmd(hci_dd, OGF_LE_CTL, OCF_LE_SET_SCAN_PARAMETERS,
+			 LE_SET_SCAN_PARAMETERS_CP_SIZE, &cp) < 0) {
+		perror("Set scan parameters failed");
+		return;
+	}
+
+	/* Window opens paused while the controller cannot scan and initiate at once. */
+	if (conn_pending && !scan_concurrent) {
+		scan_paused = true;
+	} else {
+		if (scan_set_enable(0x01) < 0)
+			return;
+
+		scan_paused = false;
+	}
+
+	DEBUG_PRINT("LE Scan ...\n");
+
+	scan_enabled = true;
+	mainloop_modify_timeout(scan_window_id, scanning_window);
+}
+
+
+/* Disable LE scanning, before the scanning window ends if a device was found. */
+static bool scan_stop(void)
+{
+	if (!scan_enabled)
+		return true;
+
+	scan_enabled = false;
+	timeout_disarm(scan_window_id);
+
+	if (scan_paused) {
+		scan_paused = false;
+		return true;
+	}
+
+	/* Kernel may have disabled scanning already, the controller then just refuses. */
+	return scan_set_enable(0x00) == 0;
+}
+
+
+/* Connection establishment starts, hold scanning if the controller cannot do both. */
+static void scan_pause(void)
+{
+	conn_pending = true;
+	conn_pending_since = monotonic_ms();
+
+	if (!scan_enabled || scan_paused || scan_concurrent)
+		return;
+
+	scan_set_enable(0x00);
+	scan_paused = true;
+}
+
+
+/* Connection establishment is over, scanning goes on for the rest of the window. */
+static void scan_resume(void)
+{
+	conn_pending = false;
+
+	if (!scan_enabled)
+		return;
+
+	/* Also undoes the kernel disabling scanning for its own attempts. */
+	scan_set_enable(0x01);
+	scan_paused = false;
+}
+
+
+/* Advertising reports of one LE meta event, an event may carry several. */
+static void hci_adv_reports(const uint8_t *data, size_t len)
+{
+	const uint8_t *end = data + len;
+	unsigned int num_reports, cred;
+	char name[DEVICE_NAME_LEN];
+#ifdef DEBUG_6LOWPAN
+	char addr[DEVICE_ADDR_LEN];
+#endif
+
+	if (!scan_enabled || !len)
+		return;
+
+	num_reports = *data++;
+
+	while (num_reports--) {
+		const le_advertising_info *info = (const void *) data;
+		uint8_t addr_type;
+		int8_t rssi;
+
+		/* Report header, advertising data and RSSI have to be within the event. */
+		if (end - data < LE_ADVERTISING_INFO_SIZE + 1 ||
+		    end - data < LE_ADVERTISING_INFO_SIZE + info->length + 1)
+			return;
+
+		data += LE_ADVERTISING_INFO_SIZE + info->length + 1;
+
+		addr_type = le_addr_type(info->bdaddr_type);
+		rssi = (int8_t) info->data[info->length];
+
+		TRACE_PROBE4(adv_report, &info->bdaddr, addr_type, rssi, info->length);
+
+#ifdef DEBUG_6LOWPAN
+		ba2str(&info->bdaddr, addr);
+#endif
+
+		if (!parse_ip_service(info->data, info->length, info->evt_type, rssi, name,
+				      sizeof(name) - 1, &cred)) {
+			DEBUG_PRINT("IPSP not supported device %s %s\n", name, addr);
+			continue;
+		}
+
+		DEBUG_PRINT("Found IPSP supported device %s %s\n", name, addr);
+
+		if (whitelist_enabled && (check_whitelist(&info->bdaddr) == false)) {
+			/* Nothing to do. Check whitelist for next entry. */
+			continue;
+		}
+
+		/* RSSI follows advertising data, candidates are ranked at end of window. */
+		node_seen(&info->bdaddr, addr_type, rssi, cred);
+	}
+}
+
+
+/* Completion of a command sent without waiting, by its opcode. */
+static void hci_cmd_complete(const evt_cmd_complete *evt, size_t len)
+{
+	const void *rp = (const uint8_t *) evt + EVT_CMD_COMPLETE_SIZE;
+
+	if (len < EVT_CMD_COMPLETE_SIZE)
+		return;
+
+	len -= EVT_CMD_COMPLETE_SIZE;
+
+	/* Commands of other users of the controller complete here too. */
+	switch (btohs(evt->opcode)) {
+	case cmd_opcode_pack(OGF_STATUS_PARAM, OCF_READ_RSSI):
+		if (len >= READ_RSSI_RP_SIZE)
+			link_rssi_read(rp);
+		break;
+	case cmd_opcode_pack(OGF_LE_CTL, OCF_LE_READ_CHANNEL_MAP):
+		if (len >= LE_READ_CHANNEL_MAP_RP_SIZE)
+			link_channel_map_read(rp);
+		break;
+	case cmd_opcode_pack(OGF_LE_CTL, OCF_LE_SET_DATA_LENGTH):
+		if (len >= sizeof(struct link_set_data_length_rp) &&
+		    ((const struct link_set_data_length_rp *) rp)->status) {
+			DEBUG_PRINT("Set data length failed, keeping %u octets\n",
+				    LINK_DEFAULT_OCTETS);
+		}
+		break;
+	default:
+		break;
+	}
+}
+
+
+/* Command sent without waiting was refused before it could start. */
+static void hci_cmd_status(const evt_cmd_status *evt, size_t len)
+{
+	if (len < EVT_CMD_STATUS_SIZE || !evt->status)
+		return;
+
+	switch (btohs(evt->opcode)) {
+	case cmd_opcode_pack(OGF_LE_CTL, OCF_LE_CONN_UPDATE):
+		fprintf(stderr, "Connection update failed: 0x%02x\n", evt->status);
+		break;
+	case cmd_opcode_pack(OGF_LE_CTL, OCF_LE_SET_PHY):
+		DEBUG_PRINT("Set PHY failed, keeping 1M PHY\n");
+		break;
+	default:
+		break;
+	}
+}
+
+
+/* Dispatch one HCI event, LE meta event, command completion or Disconnection Complete. */
+static void hci_dispatch(const uint8_t *buf, size_t len)
+{
+	const hci_event_hdr *hdr = (const void *) (buf + 1);
+	const evt_le_meta_event *meta = (const void *) (buf + 1 + HCI_EVENT_HDR_SIZE);
+
+	if (len < 1 + HCI_EVENT_HDR_SIZE + 1 || buf[0] != HCI_EVENT_PKT)
+		return;
+
+	len -= 1 + HCI_EVENT_HDR_SIZE;
+
+	if (hdr->evt == EVT_DISCONN_COMPLETE) {
+		if (len >= EVT_DISCONN_COMPLETE_SIZE)
+			link_disconnected((const void *) meta);
+		return;
+	}
+
+	if (hdr->evt == EVT_CMD_COMPLETE) {
+		hci_cmd_complete((const void *) meta, len);
+		return;
+	}
+
+	if (hdr->evt == EVT_CMD_STATUS) {
+		hci_cmd_status((const void *) meta, len);
+		return;
+	}
+
+	if (hdr->evt != EVT_LE_META_EVENT)
+		return;
+
+	len--;
+
+	switch (meta->subevent) {
+	case EVT_LE_ADVERTISING_REPORT:
+		hci_adv_reports(meta->data, len);
+		break;
+	case EVT_LE_CONN_COMPLETE:
+		{
+			const evt_le_connection_complete *evt = (const void *) meta->data;
+
+			if (len < EVT_LE_CONN_COMPLETE_SIZE)
+				break;
+
+			/* Attempt is over whatever its outcome, also a cancelled one. */
+			scan_resume();
+
+			if (!evt->status)
+				link_setup(&evt->peer_bdaddr,
+					   le_addr_type(evt->peer_bdaddr_type),
+					   btohs(evt->handle));
+		}
+		break;
+	case EVT_LE_CONN_UPDATE_COMPLETE:
+		if (len >= EVT_LE_CONN_UPDATE_COMPLETE_SIZE)
+			link_conn_updated((const void *) meta->data);
+		break;
+	case EVT_LE_DATA_LENGTH_CHANGE:
+		if (len >= sizeof(struct link_data_length_change_evt))
+			link_data_length_changed((const void *) meta->data);
+		break;
+	case EVT_LE_PHY_UPDATE_COMPLETE:
+		if (len >= sizeof(struct link_phy_update_evt))
+			link_phy_updated((const void *) meta->data);
+		break;
+	default:
+		/* Other subevents do not concern the daemon, scanning goes on. */
+		break;
+	}
+}
+
+
+/* HCI socket readable, drain every queued event in batches of the ring. */
+static void hci_event(int fd, uint32_t events, void *user_data)
+{
+	int i, n;
+
+	if (events & (EPOLLERR | EPOLLHUP)) {
+		printf("poll hci dev error\n");
+		mainloop_quit();
+		return;
+	}
+
+	do {
+		n = recvmmsg(fd, hci_msgs, HCI_EVENT_BATCH, MSG_DONTWAIT, NULL);
+		if (n < 0) {
+			if (errno == EAGAIN || errno == EINTR)
+				return;
+
+			/* Socket is unusable, exit so the init script restarts the daemon. */
+			perror("Read HCI events failed");
+			mainloop_quit();
+			return;
+		}
+
+		for (i = 0; i < n; i++)
+			hci_dispatch(hci_ring[i], hci_msgs[i].msg_len);
+	} while (n == HCI_EVENT_BATCH);
+}
+
+
+/* Arm the next scanning cycle, one delay after the start of the current one. */
+static void scan_cycle_arm(void)
+{
+	scan_next_cycle = scan_cycle_start + scan_delay();
+	timeout_arm_at(scan_cycle_id, scan_next_cycle);
+}
+
+
+/* Scanning is needed for nodes of wildcard rules, and for nodes a direct attempt missed. */
+static bool direct_scan_needed(void)
+{
+	return direct_missed || (whitelist_lengths & ~(1 << 6));
+}
+
+
+/* Round of direct attempts is over, scan if needed, else wait for the next cycle. */
+static void direct_round_end(void)
+{
+	int conn_num;
+
+	direct_active = false;
+	timeout_disarm(direct_timeout_id);
+
+	conn_num = current_conn_num(dev_id);
+	if (direct_scan_needed() && conn_num >= 0 && conn_num < MAX_BLE_CONN) {
+		scan_cycle_count++;
+		scan_start();
+		return;
+	}
+
+	scan_backoff_update(direct_connected > 0);
+	scan_cycle_arm();
+}
+
+
+/* Try the next white listed node which is not connected, rotating through the list. */
+static void direct_next(void)
+{
+	struct hci_conn_list_req *cl;
+	struct node *node;
+	int j;
+
+	/* Pairing creates the link itself, wait for it to finish. */
+	if (pairing_in_progress) {
+		mainloop_modify_timeout(direct_timeout_id, DIRECT_TIMEOUT);
+		return;
+	}
+
+	cl = read_conn_list(dev_id);
+
+	while (cl && cl->conn_num < MAX_BLE_CONN && direct_budget &&
+	       direct_visited < whitelist_slots) {
+		const struct whitelist_entry *entry = &whitelist[direct_pos];
+
+		direct_pos = (direct_pos + 1) & (whitelist_slots - 1);
+		direct_visited++;
+
+		if (!entry->used || entry->deny || entry->len != 6)
+			continue;
+
+		for (j = 0; j < cl->conn_num; j++) {
+			if (!bacmp(&cl->conn_info[j].bdaddr, &entry->bdaddr))
+				break;
+		}
+
+		if (j < cl->conn_num)
+			continue;
+
+		/* Address type is public, unless scanning found the node with another one. */
+		node = node_get(&entry->bdaddr, BDADDR_LE_PUBLIC);
+		if (!node || node->retry_after > monotonic_ms())
+			continue;
+
+		node->attempts++;
+
+		direct_budget--;
+		bacpy(&direct_bdaddr, &entry->bdaddr);
+
+		commission_device(&node->bdaddr, node->addr_type);
+		mainloop_modify_timeout(direct_timeout_id, DIRECT_TIMEOUT);
+		return;
+	}
+
+	direct_round_end();
+}
+
+
+/* Direct attempt took too long, the node is away or uses another address type. */
+static void direct_timeout(int id, void *user_data)
+{
+	/* Round ended while the expiry was pending. */
+	if (!direct_active)
+		return;
+
+	if (!pairing_in_progress) {
+		/* Controller gives up the pending LE Create Connection. */
+		hci_send_cmd(hci_dd, OGF_LE_CTL, OCF_LE_CREATE_CONN_CANCEL, 0, NULL);
+		direct_missed = true;
+	}
+
+	direct_next();
+}
+
+
+/* Link of the node of the pending direct attempt is up, go on with the next one. */
+static void direct_link_up(const bdaddr_t *bdaddr)
+{
+	if (!direct_active || bacmp(bdaddr, &direct_bdaddr))
+		return;
+
+	direct_connected++;
+	direct_next();
+}
+
+
+/* Start a round of direct attempts, one per free slot. */
+static void direct_round_start(unsigned int free_slots)
+{
+	direct_active = true;
+	direct_missed = false;
+	direct_budget = free_slots;
+	direct_visited = 0;
+	direct_connected = 0;
+
+	whitelist_reload();
+	direct_next();
+}
+
+
+/* Scanning window elapsed. */
+static void scan_window_timeout(int id, void *user_data)
+{
+	/* One failed write must not end scanning, the cycles go on. */
+	if (!scan_stop())
+		fprintf(stderr, "Scanning window not closed\n");
+
+	scan_backoff_update(scheduler_admit() > 0 || direct_connected > 0);
+	scan_cycle_arm();
+}
+
+
+/* Start of the next scanning interval. */
+static void scan_cycle_timeout(int id, void *user_data)
+{
+	uint64_t now = monotonic_ms();
+	int conn_num;
+
+	/* Intervals are counted start to start, cycles missed while busy are skipped. */
+	scan_cycle_start = scan_next_cycle;
+	if (scan_cycle_start + scan_delay() <= now)
+		scan_cycle_start = now;
+
+	scan_cycle_arm();
+
+	/* Attempt never completed, scanning must not stay paused for it. */
+	if (conn_pending && now - conn_pending_since > CONN_PENDING_TIMEOUT)
+		conn_pending = false;
+
+	/* Scanning overlaps pairing and connecting, only direct rounds hold it. */
+	if (scan_enabled || direct_active)
+		return;
+
+	/* Scan the IPSP device */
+	conn_num = current_conn_num(dev_id);
+	if (conn_num >= 0 && conn_num < MAX_BLE_CONN) {
+		/* White listed nodes are tried first, scanning follows if needed. */
+		if (direct_connect) {
+			direct_round_start(MAX_BLE_CONN - conn_num);
+			return;
+		}
+
+		scan_cycle_count++;
+		scan_start();
+		return;
+	}
+
+	/* All slots taken, a disconnection brings the next cycle forward. */
+	scan_backoff_update(false);
+	scan_cycle_arm();
+}
+
+
+/* Scan right away at the shortest interval, a slot freed up or it was asked for. */
+static void scheduler_kick(void)
+{
+	scan_backoff = 1;
+
+	if (kernel_discovery) {
+		if (discovery_timeout_id >= 0 && !discovery_active)
+			mainloop_modify_timeout(discovery_timeout_id, 1);
+		return;
+	}
+
+	if (scan_cycle_id < 0 || scan_enabled)
+		return;
+
+	scan_next_cycle = monotonic_ms();
+	timeout_arm_at(scan_cycle_id, scan_next_cycle);
+}
+
+
+/* Receive LE meta, disconnection and command completion events on the HCI socket. */
+static bool hci_events_init(void)
+{
+	struct hci_filter nf;
+	int i, flags;
+
+	hci_filter_clear(&nf);
+	hci_filter_set_ptype(HCI_EVENT_PKT, &nf);
+	hci_filter_set_event(EVT_LE_META_EVENT, &nf);
+	hci_filter_set_event(EVT_DISCONN_COMPLETE, &nf);
+	hci_filter_set_event(EVT_CMD_COMPLETE, &nf);
+	hci_filter_set_event(EVT_CMD_STATUS, &nf);
+
+	if (setsockopt(hci_dd, SOL_HCI, HCI_FILTER, &nf, sizeof(nf)) < 0) {
+		printf("Could not set socket options\n");
+		mainloop_quit();
+		return false;
+	}
+
+	/* Events are drained without blocking, into the ring set up once here. */
+	flags = fcntl(hci_dd, F_GETFL);
+	if (flags < 0 || fcntl(hci_dd, F_SETFL, flags | O_NONBLOCK) < 0) {
+		perror("Could not set HCI socket non-blocking");
+		mainloop_quit();
+		return false;
+	}
+
+	for (i = 0; i < HCI_EVENT_BATCH; i++) {
+		hci_iov[i].iov_base = hci_ring[i];
+		hci_iov[i].iov_len = sizeof(hci_ring[i]);
+		hci_msgs[i].msg_hdr.msg_iov = &hci_iov[i];
+		hci_msgs[i].msg_hdr.msg_iovlen = 1;
+	}
+
+	mainloop_add_fd(hci_dd, EPOLLIN, hci_event, NULL, NULL);
+
+	return true;
+}
+
+
+/* Start userspace scanning, one scanning window per interval. */
+static void scan_init(unsigned int delay)
+{
+	if (!hci_events_init())
+		return;
+
+	/* Timers are created disarmed and rearmed, scheduling does not allocate. */
+	scan_window_id = mainloop_add_timeout(0, scan_window_timeout, NULL, NULL);
+	scan_cycle_id = mainloop_add_timeout(0, scan_cycle_timeout, NULL, NULL);
+	if (direct_connect)
+		direct_timeout_id = mainloop_add_timeout(0, direct_timeout, NULL, NULL);
+
+	/* First scanning window starts after delay, right away unless reconnecting. */
+	scan_cycle_start = scan_next_cycle = monotonic_ms() + delay;
+	timeout_arm_at(scan_cycle_id, scan_next_cycle);
+}
+
+
+/* Management API add device complete. */
+static void add_device_complete(uint8_t status, uint16_t len,
+				const void *param, void *user_data)
+{
+	if (status)
+		fprintf(stderr, "Add device failed: %s\n", mgmt_errstr(status));
+}
+
+
+/* Management API remove device complete. */
+static void remove_device_complete(uint8_t status, uint16_t len,
+				   const void *param, void *user_data)
+{
+	if (status)
+		fprintf(stderr, "Remove device failed: %s\n", mgmt_errstr(status));
+}
+
+
+/* Index of an address on the kernel auto-connect list, -1 if it is not on it. */
+static int autoconnect_find(const bdaddr_t *bdaddr)
+{
+	unsigned int i;
+
+	for (i = 0; i < autoconnect_count; i++) {
+		if (!bacmp(&autoconnect[i].bdaddr, bdaddr))
+			return i;
+	}
+
+	return -1;
+}
+
+
+/* Stop the kernel reconnecting a device which is no longer white listed. */
+static void discovery_remove_device(unsigned int i)
+{
+	struct mgmt_cp_remove_device cp;
+
+	memset(&cp, 0, sizeof(cp));
+	cp.addr = autoconnect[i];
+
+	mgmt_send(mgmt, MGMT_OP_REMOVE_DEVICE, dev_id, sizeof(cp), &cp,
+		  remove_device_complete, NULL, NULL);
+
+	autoconnect[i] = autoconnect[--autoconnect_count];
+}
+
+
+/* Hand over reconnection of a white listed device to the kernel, false if it already was. */
+static bool discovery_add_device(const bdaddr_t *bdaddr, uint8_t type)
+{
+	struct mgmt_cp_add_device cp;
+	char addr[DEVICE_ADDR_LEN];
+	int i;
+
+	i = autoconnect_find(bdaddr);
+	if (i >= 0 && autoconnect[i].type == type)
+		return false;
+
+	/* Listed under another address type, it would never connect. */
+	if (i >= 0)
+		discovery_remove_device(i);
+
+	if (autoconnect_count == pools[POOL_WHITELIST].size) {
+		ba2str(bdaddr, addr);
+		fprintf(stderr, "Auto-connect list full, not adding %s\n", addr);
+		return false;
+	}
+
+	memset(&cp, 0, sizeof(cp));
+	bacpy(&cp.addr.bdaddr, bdaddr);
+	cp.addr.type = type;
+	cp.action = ADD_DEVICE_AUTO_CONNECT;
+
+	mgmt_send(mgmt, MGMT_OP_ADD_DEVICE, dev_id, sizeof(cp), &cp,
+		  add_device_complete, NULL, NULL);
+
+	autoconnect[autoconnect_count++] = cp.addr;
+
+	return true;
+}
+
+
+/* Bring the kernel auto-connect list in line with the whitelist, after every reload. */
+static void discovery_load_whitelist(void)
+{
+	const struct whitelist_entry *entry;
+	struct node *node;
+	unsigned int i;
+
+	if (!kernel_discovery || !whitelist_enabled || discovery_timeout_id < 0)
+		return;
+
+	/* Removed and denied nodes are no longer reconnected. */
+	for (i = 0; i < autoconnect_count;) {
+		entry = whitelist_lookup(&autoconnect[i].bdaddr);
+		if (entry && !entry->deny)
+			i++;
+		else
+			discovery_remove_device(i);
+	}
+
+	/* Nodes matching wildcard rules are added once discovery finds them. */
+	for (i = 0; i < whitelist_slots; i++) {
+		if (!whitelist[i].used || whitelist[i].deny || whitelist[i].len != 6)
+			continue;
+
+		if (autoconnect_find(&whitelist[i].bdaddr) >= 0)
+			continue;
+
+		node = node_find(&whitelist[i].bdaddr);
+		discovery_add_device(&whitelist[i].bdaddr,
+				     node ? node->addr_type : BDADDR_LE_PUBLIC);
+	}
+}
+
+
+/* Management API device found event. */
+static void device_found_event(uint16_t index, uint16_t len,
+			       const void *param, void *user_data)
+{
+	const struct mgmt_ev_device_found *ev = param;
+	char name[DEVICE_NAME_LEN];
+	struct node *node;
+	unsigned int cred;
+	uint16_t eir_len;
+#ifdef DEBUG_6LOWPAN
+	char addr[DEVICE_ADDR_LEN];
+#endif
+
+	if (len < sizeof(*ev))
+		return;
+
+	eir_len = get_le16(&ev->eir_len);
+	if (len != sizeof(*ev) + eir_len)
+		return;
+
+	TRACE_PROBE4(adv_report, &ev->addr.bdaddr, ev->addr.type, ev->rssi, eir_len);
+
+#ifdef DEBUG_6LOWPAN
+	ba2str(&ev->addr.bdaddr, addr);
+#endif
+
+	if (!parse_ip_service(ev->eir, eir_len, ADV_TYPE_UNKNOWN, ev->rssi, name,
+			      sizeof(name) - 1, &cred)) {
+		DEBUG_PRINT("IPSP not supported device %s %s\n", name, addr);
+		return;
+	}
+
+	DEBUG_PRINT("Found IPSP supported device %s %s\n", name, addr);
+
+	if (whitelist_enabled) {
+		/* Kernel connects the device, handled in device_connected_event(). */
+		if (check_whitelist(&ev->addr.bdaddr)) {
+			/* Node is tracked for the passkey of its pairing. */
+			node = node_get(&ev->addr.bdaddr, ev->addr.type);
+			if (node)
+				node_set_ssid(node, cred);
+			if (discovery_add_device(&ev->addr.bdaddr, ev->addr.type))
+				discovery_added++;
+		}
+		return;
+	}
+
+	node_seen(&ev->addr.bdaddr, ev->addr.type, ev->rssi, cred);
+}
+
+
+/* Management API device connected event. */
+static void device_connected_event(uint16_t index, uint16_t len,
+				   const void *param, void *user_data)
+{
+	const struct mgmt_ev_device_connected *ev = param;
+	struct mgmt_cp_disconnect cp;
+#ifdef DEBUG_6LOWPAN
+	char addr[DEVICE_ADDR_LEN];
+#endif
+
+	if (len < sizeof(*ev) || ev->addr.type == BDADDR_BREDR)
+		return;
+
+	/* Only links established by the auto-connect list are handled here. */
+	if (!whitelist_enabled)
+		return;
+
+#ifdef DEBUG_6LOWPAN
+	ba2str(&ev->addr.bdaddr, addr);
+	DEBUG_PRINT("Device %s connected\n", addr);
+#endif
+
+	if (check_whitelist(&ev->addr.bdaddr)) {
+		commission_device(&ev->addr.bdaddr, ev->addr.type);
+		return;
+	}
+
+	/* Connected before its removal reached the kernel, free the slot. */
+	memset(&cp, 0, sizeof(cp));
+	cp.addr = ev->addr;
+	mgmt_send(mgmt, MGMT_OP_DISCONNECT, dev_id, sizeof(cp), &cp, NULL, NULL, NULL);
+}
+
+
+static void start_discovery(void);
+
+
+/* Restart discovery once the scanning interval elapsed. */
+static void discovery_timeout(int id, void *user_data)
+{
+	start_discovery();
+}
+
+
+/* Management API discovering event. */
+static void discovering_event(uint16_t index, uint16_t len,
+			      const void *param, void *user_data)
+{
+	const struct mgmt_ev_discovering *ev = param;
+
+	if (len < sizeof(*ev) || ev->discovering)
+		return;
+
+	DEBUG_PRINT("Discovery stopped\n");
+
+	discovery_active = false;
+
+	if (whitelist_enabled)
+		scan_backoff_update(discovery_added > 0);
+	else
+		scan_backoff_update(scheduler_admit() > 0);
+
+	/* Kernel finished its discovery window, wait for next one. */
+	mainloop_modify_timeout(discovery_timeout_id, scan_delay());
+}
+
+
+/* Management API start discovery result. */
+static void start_discovery_complete(uint8_t status, uint16_t len,
+				     const void *param, void *user_data)
+{
+	struct mgmt_cp_start_discovery cp;
+
+	if (!status)
+		return;
+
+	if (status == MGMT_STATUS_UNKNOWN_CMD && user_data) {
+		/* Service discovery is not supported, filter in parse_ip_service() only. */
+		memset(&cp, 0, sizeof(cp));
+		cp.type = DISCOVERY_TYPE_LE;
+		mgmt_send(mgmt, MGMT_OP_START_DISCOVERY, dev_id, sizeof(cp), &cp,
+			  start_discovery_complete, NULL, NULL);
+		return;
+	}
+
+	fprintf(stderr, "Start discovery failed: %s\n", mgmt_errstr(status));
+
+	discovery_active = false;
+	mainloop_modify_timeout(discovery_timeout_id, scan_delay());
+}
+
+
+/* Start kernel discovery of LE devices advertising IPSP service. */
+static void start_discovery(void)
+{
+	uint8_t buf[sizeof(struct mgmt_cp_start_service_discovery) + sizeof(ipsp_uuid128)];
+	struct mgmt_cp_start_service_discovery *cp = (void *) buf;
+
+	if (current_conn_num(dev_id) >= MAX_BLE_CONN) {
+		/* No free slot, a disconnection brings the next discovery forward. */
+		scan_backoff_update(false);
+		mainloop_modify_timeout(discovery_timeout_id, scan_delay());
+		return;
+	}
+
+	DEBUG_PRINT("LE Discovery ...\n");
+
+	scan_cycle_count++;
+	discovery_active = true;
+	discovery_added = 0;
+
+	memset(buf, 0, sizeof(buf));
+	cp->type = DISCOVERY_TYPE_LE;
+	cp->rssi = DISCOVERY_RSSI_NONE;
+	put_le16(1, &cp->uuid_count);
+	memcpy(cp->uuids[0], ipsp_uuid128, sizeof(ipsp_uuid128));
+
+	mgmt_send(mgmt, MGMT_OP_START_SERVICE_DISCOVERY, dev_id, sizeof(buf), buf,
+		  start_discovery_complete, UINT_TO_PTR(1), NULL);
+}
+
+
+/* Let the kernel schedule scanning and reconnection, react on mgmt events only. */
+static void discovery_start(void)
+{
+	mgmt_register(mgmt, MGMT_EV_DEVICE_FOUND, dev_id,
+		      device_found_event, NULL, NULL);
+	mgmt_register(mgmt, MGMT_EV_DEVICE_CONNECTED, dev_id,
+		      device_connected_event, NULL, NULL);
+	mgmt_register(mgmt, MGMT_EV_DISCOVERING, dev_id,
+		      discovering_event, NULL, NULL);
+
+	discovery_timeout_id = mainloop_add_timeout(0, discovery_timeout, NULL, NULL);
+
+	if (whitelist_enabled) {
+		whitelist_reload();
+		discovery_load_whitelist();
+	}
+
+	start_discovery();
+}
+
+
+/* Write the nodes known to the scheduler into the snapshot on tmpfs, using atomic rename. */
+static void state_save(void)
+{
+	struct hci_conn_list_req *cl = read_conn_list(dev_id);
+	unsigned int i, count = 0;
+	uint32_t header[2];
+	ssize_t len;
+	bool ok;
+	int fd, j;
+
+	for (i = 0; i < pools[POOL_NODES].size; i++) {
+		const struct node *node = &nodes[i];
+		struct node_state *st = &state_buf[count];
+
+		if (!node->used)
+			continue;
+
+		memset(st, 0, sizeof(*st));
+		bacpy(&st->bdaddr, &node->bdaddr);
+		st->addr_type = node->addr_type;
+		st->profile = node->profile;
+		st->tx_phy = node->tx_phy;
+		st->rx_phy = node->rx_phy;
+		st->rssi_avg = node->rssi_avg;
+		st->tx_octets = node->tx_octets;
+		st->rx_octets = node->rx_octets;
+		st->attempts = node->attempts;
+		st->successes = node->successes;
+		st->link_recycles = node->link_recycles;
+
+		for (j = 0; cl && j < cl->conn_num; j++) {
+			if (!bacmp(&cl->conn_info[j].bdaddr, &node->bdaddr))
+				st->connected = 1;
+		}
+
+		count++;
+	}
+
+	header[0] = STATE_MAGIC;
+	header[1] = count;
+	len = count * sizeof(*state_buf);
+
+	fd = open(STATE_TMP_PATH, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+	if (fd < 0) {
+		perror("Open state snapshot failed");
+		return;
+	}
+
+	/* Snapshot is on tmpfs and does not outlive a reboot, no fsync. */
+	ok = write(fd, header, sizeof(header)) == sizeof(header) &&
+	     write(fd, state_buf, len) == len;
+
+	close(fd);
+
+	if (!ok || rename(STATE_TMP_PATH, STATE_PATH) == -1) {
+		perror("Write state snapshot failed");
+		unlink(STATE_TMP_PATH);
+	}
+}
+
+
+/* Periodic snapshot, the last one before a crash or SIGKILL is used on restart. */
+static void state_timeout(int id, void *user_data)
+{
+	state_save();
+
+	mainloop_modify_timeout(id, STATE_INTERVAL);
+}
+
+
+/* Restore the nodes of the snapshot and reconnect those connected before the restart. */
+static unsigned int state_restore(void)
+{
+	uint64_t now = monotonic_ms();
+	uint32_t header[2];
+	unsigned int i, queued = 0;
+	ssize_t len;
+	int fd;
+
+	fd = open(STATE_PATH, O_RDONLY);
+	if (fd < 0)
+		return 0;
+
+	if (read(fd, header, sizeof(header)) != sizeof(header) ||
+	    header[0] != STATE_MAGIC || header[1] > pools[POOL_NODES].size) {
+		fprintf(stderr, "Ignoring corrupted state snapshot %s\n", STATE_PATH);
+		close(fd);
+		return 0;
+	}
+
+	len = header[1] * sizeof(*state_buf);
+	if (read(fd, state_buf, len) != len) {
+		fprintf(stderr, "Ignoring corrupted state snapshot %s\n", STATE_PATH);
+		close(fd);
+		return 0;
+	}
+
+	close(fd);
+
+	for (i = 0; i < header[1]; i++) {
+		const struct node_state *st = &state_buf[i];
+		struct node *node = node_get(&st->bdaddr, st->addr_type);
+
+		if (!node)
+			break;
+
+		node->rssi_avg = st->rssi_avg;
+		node->attempts = st->attempts;
+		node->successes = st->successes;
+		node->link_recycles = st->link_recycles;
+		node->profile = st->profile < PROFILE_COUNT ? st->profile : default_profile;
+		node->tx_octets = st->tx_octets;
+		node->rx_octets = st->rx_octets;
+		node->tx_phy = st->tx_phy;
+		node->rx_phy = st->rx_phy;
+		node->last_seen = now;
+
+		/* Kernel reconnects the nodes of its auto-connect list on its own. */
+		if (!st->connected || (kernel_discovery && whitelist_enabled))
+			continue;
+
+		if (whitelist_enabled && !check_whitelist(&st->bdaddr))
+			continue;
+
+		if (admit_push(node))
+			queued++;
+	}
+
+	printf("Restored %u nodes, reconnecting %u\n", header[1], queued);
+
+	commission_next();
+
+	return queued;
+}
+
+
+/* Signal readiness through pidfile and notify fd, once scanning started. */
+static void notify_ready(void)
+{
+	FILE *fp;
+
+	if (pidfile_path) {
+		fp = fopen(pidfile_path, "w");
+		if (fp) {
+			fprintf(fp, "%d\n", getpid());
+			fclose(fp);
+		} else {
+			perror("Write pidfile failed");
+		}
+	}
+
+	if (notify_fd >= 0) {
+		if (write(notify_fd, "READY=1\n", 8) != 8)
+			perror("Write notify fd failed");
+		close(notify_fd);
+		notify_fd = -1;
+	}
+}
+
+
+/* Start scanning for IPSP nodes, once the controller is ready. */
+static void start_6lowpan(void)
+{
+	unsigned int reconnecting;
+
+	events_init();
+
+	/* Long journals are compacted shortly after the reload which found them. */
+	compact_timeout_id = mainloop_add_timeout(0, compact_timeout, NULL, NULL);
+
+	/* First load hands the profiles of whitelisted nodes to the kernel. */
+	whitelist_reload();
+	link_features_init();
+
+	/* Deadlines of pairings and connects, armed per operation. */
+	pair_timeout_id = mainloop_add_timeout(0, pair_timeout, NULL, NULL);
+	connect_timeout_id = mainloop_add_timeout(0, connect_timeout, NULL, NULL);
+
+	/* Nodes connected before a restart are reconnected before scanning resumes. */
+	reconnecting = state_restore();
+	state_timeout_id = mainloop_add_timeout(STATE_INTERVAL, state_timeout, NULL, NULL);
+
+	/* Link events are read from the HCI socket in both modes. */
+	if (kernel_discovery) {
+		if (hci_events_init())
+			discovery_start();
+	} else {
+		scan_init(reconnecting ? scanning_interval : 0);
+	}
+
+	stats_check();
+	stats_timeout_id = mainloop_add_timeout(STATS_INTERVAL, stats_timeout,
+						NULL, NULL);
+
+	if (link_interval)
+		link_timeout_id = mainloop_add_timeout(link_interval, link_timeout,
+						       NULL, NULL);
+
+	if (probe_interval)
+		probe_init();
+
+	netif_init();
+
+	notify_ready();
+}
+
+
+/* Open the HCI device and bring up the controller. */
+static void open_device(void)
+{
+	DEBUG_PRINT("HCI Device ID = %d\r\n", dev_id);
+
+	hci_dd = hci_open_dev(dev_id);
+	if (hci_dd < 0) {
+		perror("Could not open device");
+		exit(0);
+	}
+
+	if (mgmt_required) {
+		/* Scanning starts from set_powered_complete(). */
+		comm_auth_register();
+		comm_auth_configure();
+	} else {
+		start_6lowpan();
+	}
+}
+
+
+/* Management API index added event, HCI device showed up. */
+static void index_added_event(uint16_t index, uint16_t len,
+			      const void *param, void *user_data)
+{
+	if (dev_id >= 0 || index != wait_index)
+		return;
+
+	timeout_disarm(index_timeout_id);
+
+	dev_id = index;
+	open_device();
+}
+
+
+/* HCI device did not show up in time. */
+static void index_timeout(int id, void *user_data)
+{
+	/* Device came up while the expiry was pending. */
+	if (dev_id >= 0)
+		return;
+
+	fprintf(stderr, "HCI device hci%u did not show up\n", wait_index);
+	mainloop_quit();
+}
+
+
+/* Wait until the kernel sends index added event of the HCI device. */
+static void wait_device(const char *hci_id)
+{
+	if (sscanf(hci_id, "hci%u", &wait_index) != 1) {
+		perror("Could not open device");
+		exit(0);
+	}
+
+	DEBUG_PRINT("Waiting for %s\n", hci_id);
+
+	mgmt_register(mgmt, MGMT_EV_INDEX_ADDED, MGMT_INDEX_NONE,
+		      index_added_event, NULL, NULL);
+	index_timeout_id = mainloop_add_timeout(SETUP_TIMEOUT, index_timeout,
+						NULL, NULL);
+
+	/* Device could have been added before registration. */
+	dev_id = hci_devid(hci_id);
+	if (dev_id >= 0) {
+		timeout_disarm(index_timeout_id);
+		open_device();
+	}
+}
+
+
+/* Poll for a debugfs node to show up, instead of sleeping a fixed time. */
+static bool wait_path(const char *path, unsigned int timeout)
+{
+	struct timespec ts = { 0, SETUP_POLL_INTERVAL * 1000000 };
+	unsigned int waited;
+
+	for (waited = 0; waited < timeout; waited += SETUP_POLL_INTERVAL) {
+		if (access(path, F_OK) == 0)
+			return true;
+
+		nanosleep(&ts, NULL);
+	}
+
+	return access(path, F_OK) == 0;
+}
+
+
+/* Write a value into a debugfs node. */
+static int write_path(const char *path, const char *value)
+{
+	int fd;
+	int ret = 0;
+
+	fd = open(path, O_WRONLY);
+	if (fd < 0)
+		return -1;
+
+	if (write(fd, value, strlen(value)) < 0)
+		ret = -1;
+
+	close(fd);
+
+	return ret;
+}
+
+
+/* Load the 6lowpan module and enable it, replaces modprobe/sleep of init script. */
+static int setup_module(void)
+{
+	pid_t pid;
+	int status;
+
+	if (access(MODULE_PATH, F_OK) != 0) {
+		pid = fork();
+		if (pid < 0) {
+			perror("Fork modprobe failed");
+			return -1;
+		}
+
+		if (pid == 0) {
+			execlp("modprobe", "modprobe", MODULE_NAME, (char *) NULL);
+			_exit(127);
+		}
+
+		if (waitpid(pid, &status, 0) < 0 || !WIFEXITED(status) ||
+		    WEXITSTATUS(status) != 0) {
+			fprintf(stderr, "Loading %s failed\n", MODULE_NAME);
+			return -1;
+		}
+	}
+
+	if (!wait_path(CONTROLLER_PATH, SETUP_TIMEOUT)) {
+		fprintf(stderr, "%s did not show up\n", CONTROLLER_PATH);
+		return -1;
+	}
+
+	/* Newer kernels enable 6lowpan, older ones listen on IPSP PSM. */
+	if (access(ENABLE_PATH, F_OK) == 0) {
+		if (write_path(ENABLE_PATH, "1") == -1) {
+			perror("Enable 6lowpan failed");
+			return -1;
+		}
+	} else if (write_path(PSM_PATH, IPSP_PSM) == -1) {
+		perror("Set 6lowpan PSM failed");
+		return -1;
+	}
+
+	return 0;
+}
+
+
+/* main process to scan/connect all IPSP slaves */
+static void process_6lowpan(char *hci_id)
+{
+	sigset_t mask;
+
+	/* Controller reset is done by power cycling it through mgmt. */
+	mgmt_required = auth_type != COMMISSIONING_AUTH_NONE || kernel_discovery ||
+			setup_6lowpan;
+
+	dev_id = hci_devid(hci_id);
+	if (dev_id < 0 && !setup_6lowpan) {
+		perror("Could not open device");
+		exit(0);
+	}
+
+	/* All steady state memory is allocated here, sized by the options. */
+	for (whitelist_slots = 1; whitelist_slots < 2 * pools[POOL_WHITELIST].size;)
+		whitelist_slots <<= 1;
+	whitelist = calloc(whitelist_slots, sizeof(*whitelist));
+	whitelist_rules = calloc(pools[POOL_WHITELIST].size, sizeof(*whitelist_rules));
+	autoconnect = calloc(pools[POOL_WHITELIST].size, sizeof(*autoconnect));
+	conn_params = malloc(sizeof(*conn_params) + pools[POOL_WHITELIST].size *
+			     sizeof(conn_params->params[0]));
+	nodes = calloc(pools[POOL_NODES].size, sizeof(*nodes));
+	state_buf = calloc(pools[POOL_NODES].size, sizeof(*state_buf));
+	if (!whitelist || !whitelist_rules || !autoconnect || !conn_params || !nodes ||
+	    !state_buf) {
+		perror("Can't allocate memory");
+		exit(0);
+	}
+
+	/* Everything runs from one mainloop, timeouts use CLOCK_MONOTONIC timerfds. */
+	mainloop_init();
+
+	sigemptyset(&mask);
+	sigaddset(&mask, SIGINT);
+	sigaddset(&mask, SIGTERM);
+	sigaddset(&mask, SIGUSR1);
+	sigaddset(&mask, SIGHUP);
+	sigaddset(&mask, SIGCHLD);
+	mainloop_set_signal(&mask, signal_callback, NULL, NULL);
+
+	if (mgmt_required)
+		comm_auth_init();
+
+	if (dev_id < 0)
+		wait_device(hci_id);
+	else
+		open_device();
+
+	mainloop_run();
+
+	if (mgmt_required && !mgmt_initialized) {
+		perror("Could not initialize authentication");
+		exit(0);
+	}
+
+	scan_stop();
+
+	/* Last snapshot, taken on SIGTERM, for a warm restart. */
+	if (state_timeout_id >= 0)
+		state_save();
+
+	if (hci_dd >= 0)
+		hci_close_dev(hci_dd);
+
+	if (probe_fd >= 0)
+		close(probe_fd);
+
+	if (netif_fd >= 0)
+		close(netif_fd);
+
+	if (events_fd >= 0) {
+		close(events_fd);
+		unlink(EVENTS_PATH);
+	}
+
+	if (mgmt_required)
+		mgmt_unref(mgmt);
+
+	if (pidfile_path)
+		unlink(pidfile_path);
+
+	free(whitelist);
+	free(whitelist_rules);
+	free(autoconnect);
+	free(conn_params);
+	free(nodes);
+	free(state_buf);
+
+	return;
+}
+
+
+/* Connect to the event socket of the running daemon. */
+static int control_connect(bool verbose)
+{
+	struct sockaddr_un addr;
+	int fd;
+
+	fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (fd < 0) {
+		perror("Could not open event socket");
+		return -1;
+	}
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strncpy(addr.sun_path, EVENTS_PATH, sizeof(addr.sun_path) - 1);
+
+	if (connect(fd, (struct sockaddr *) &addr, sizeof(addr)) < 0) {
+		if (verbose)
+			perror("Daemon is not running");
+		close(fd);
+		return -1;
+	}
+
+	return fd;
+}
+
+
+/* Send a request to the running daemon. */
+static void control_send(const char *request, bool verbose)
+{
+	int fd = control_connect(verbose);
+
+	if (fd < 0)
+		return;
+
+	if (write(fd, request, strlen(request)) < 0 && verbose)
+		perror("Request failed");
+
+	close(fd);
+}
+
+
+/* Append one record to the write locked journal */
+static int whitelist_journal_append(int fd, const char *record)
+{
+	int len = strlen(record);
+
+	if (write(fd, record, len) != len || fsync(fd) == -1) {
+		perror("Write journal failed");
+		return -1;
+	}
+
+	return 0;
+}
+
+
+/* Append one record to the whitelist journal, the daemon replays it on its next check */
+static int whitelist_journal_write(const char *record)
+{
+	int fd, err = -1;
+
+	fd = open(CONFIG_JOURNAL_PATH, O_WRONLY | O_CREAT | O_APPEND, 0644);
+	if (fd < 0) {
+		perror("Open journal failed");
+		return -1;
+	}
+
+	if (whitelist_lock(fd, F_WRLCK, true) == -1)
+		perror("Lock journal failed");
+	else
+		err = whitelist_journal_append(fd, record);
+
+	close(fd);
+
+	return err;
+}
+
+
+static int whitelist_load_locked(short type, int *fd);
+
+
+/* Append an address or deny rule to the whitelist */
+static int whitelist_append(const char *key, const char *rule, const char *profile)
+{
+	char record[CONFIG_LINE_MAX];
+	uint8_t lo[6], hi[6];
 
-		ptr = buf + (1 + HCI_EVENT_HDR_SIZE);
-		meta = (void *) ptr;
+	DEBUG_PRINT("Add %s %s to white list\n", key, rule);
 
-		if (meta->subevent != EVT_LE_ADVERTISING_REPORT)
-			goto done;
+	if (!rule || rule_parse(rule, lo, hi) < 0) {
+		perror("input address not correct");
+		return -1;
+	}
 
-		/* Ignoring multiple reports */
-		info = (le_advertising_info *) (meta->data + 1);
+	if (profile && conn_profile_find(profile) < 0) {
+		fprintf(stderr, "Unknown connection profile %s\n", profile);
+		return -1;
+	}
 
-		ba2str(&info->bdaddr, addr);
-		if (parse_ip_service(info->data, info->length, name, sizeof(name) - 1)) {
-			DEBUG_PRINT("Found IPSP supported device %s %s\n", name, addr);
-			memcpy(dev_name, name, sizeof(name));
-			memcpy(dev_addr, addr, sizeof(addr));
-			if (use_whitelist && (check_whitelist(addr) == false)) {
-				/* Nothing to do. Check whitelist for next entry. */
-			} else {
-				scan_ret = true;
-				break;
-			}
-		} else {
-			DEBUG_PRINT("IPSP not supported device %s %s\n", name, addr);
-		}
+	if (profile)
+		snprintf(record, sizeof(record), "{\n\t%s=\"%s\"\n\tprofile=\"%s\"\n}\n",
+			 key, rule, profile);
+	else
+		snprintf(record, sizeof(record), "{\n\t%s=\"%s\"\n}\n", key, rule);
+
+	return whitelist_journal_write(record);
+}
+
+
+/* Add device, address prefix or range into white list */
+static void cmd_addwl(char *argv[])
+{
+	/* New nodes are looked for right away, the daemon may be backing off. */
+	if (whitelist_append("address", argv[0], argv[0] ? argv[1] : NULL) == 0)
+		control_send("scan\n", false);
+}
+
+
+/* Exclude device, address prefix or range from white list rules */
+static void cmd_denywl(char *argv[])
+{
+	whitelist_append("deny", argv[0], NULL);
+}
+
+
+/* Remove device from white list */
+static void cmd_rmwl(char *argv[])
+{
+	char *addr = argv[0];
+	char record[CONFIG_LINE_MAX];
+	int fd, err, loaded;
+
+	DEBUG_PRINT("Remove %s from white list\n", addr);
+
+	if (!addr || strlen(addr) >= 2 * DEVICE_ADDR_LEN) {
+		perror("input address not correct");
+		return;
 	}
 
-done:
-	setsockopt(dd, SOL_HCI, HCI_FILTER, &of, sizeof(of));
-	err = hci_le_set_scan_enable(dd, 0x00, filter_dup, 10000);
-	if (err < 0) {
-		perror("Disable scan failed");
-		scan_ret = false;
+	loaded = whitelist_load_locked(F_WRLCK, &fd);
+	if (loaded == -1)
+		return;
+
+	/* Record of an unknown rule would only grow the journal, unless rules did not fit. */
+	if (fd < 0 || (loaded == 0 && whitelist_rule_find(addr) < 0)) {
+		fprintf(stderr, "%s is not in white list\n", addr);
+		if (fd >= 0)
+			close(fd);
+		free(whitelist_rules);
+		return;
 	}
 
-	return scan_ret;
+	/* Removal is one appended record, the snapshot is rewritten on compaction only. */
+	snprintf(record, sizeof(record), "remove=\"%s\"\n", addr);
+	err = whitelist_journal_append(fd, record);
+	close(fd);
+	free(whitelist_rules);
+
+	if (err == -1)
+		return;
+
+	/* Only a single device is disconnected, by the daemon which knows its address type. */
+	if (strlen(addr) != 17 || bachk(addr) < 0)
+		return;
+
+	snprintf(record, sizeof(record), "disconnect %s\n", addr);
+	control_send(record, false);
 }
 
 
-/* Management API passkey request. */
-static void passkey_request_event(uint16_t index, uint16_t len,
-				  const void *param, void *user_data)
+/* Clear the content of white list */
+static void cmd_clearwl(char *argv[])
 {
-	const struct mgmt_ev_pin_code_request *ev = param;
-	static struct mgmt_cp_user_passkey_reply cp;
-	char str[18];
+	int fd, cfg;
 
-	ba2str(&ev->addr.bdaddr, str);
+	DEBUG_PRINT("Clear white list\n");
 
-	memset(&cp, 0, sizeof(cp));
-	memcpy(&cp.addr, &ev->addr, sizeof(cp.addr));
-	put_le32(atoi(auth_key_value), &cp.passkey);
+	fd = open(CONFIG_JOURNAL_PATH, O_WRONLY | O_CREAT | O_APPEND, 0644);
+	if (fd < 0 || whitelist_lock(fd, F_WRLCK, true) == -1) {
+		perror("Open journal failed");
+		if (fd >= 0)
+			close(fd);
+		return;
+	}
 
-	DEBUG_PRINT("Passkey request: %d\r\n", cp.passkey);
+	cfg = open(CONFIG_PATH, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (cfg < 0)
+		perror("Open config failed");
+	else
+		close(cfg);
 
-	/* Reply with correct passkey. */
-	mgmt_reply(mgmt, MGMT_OP_USER_PASSKEY_REPLY, index, sizeof(cp), &cp,
-		   NULL, NULL, NULL);
+	if (ftruncate(fd, 0) == -1)
+		perror("Truncate journal failed");
+
+	close(fd);
 }
 
 
-/* Management API configuration result. */
-static void set_cfg_complete(uint8_t status, uint16_t len,
-			     const void *param, void *user_data)
+/*
+ * Replay snapshot and journal for a command, the journal stays locked until fd is closed.
+ * Returns 1 if rules did not fit the cache.
+ */
+static int whitelist_load_locked(short type, int *fd)
 {
-	const char *fn_name = user_data;
+	whitelist_rules = calloc(pools[POOL_WHITELIST].size, sizeof(*whitelist_rules));
+	if (!whitelist_rules) {
+		perror("Can't allocate memory");
+		return -1;
+	}
 
-	if (status) {
-		fprintf(stderr, "Configuration command %s failed - reason: %s\n",
-				fn_name, mgmt_errstr(status));
-		mainloop_quit();
-		return;
+	*fd = open(CONFIG_JOURNAL_PATH, type == F_WRLCK ? O_RDWR | O_CREAT | O_APPEND :
+		   O_RDONLY, 0644);
+	if (*fd >= 0 && whitelist_lock(*fd, type, true) == -1) {
+		perror("Lock journal failed");
+		close(*fd);
+		return -1;
 	}
+
+	return whitelist_replay(*fd) ? 0 : 1;
 }
 
 
-/* Management API pairing result. */
-static void pair_device_complete(uint8_t status, uint16_t len,
-				 const void *param, void *user_data)
+/* List the content of white list */
+static void cmd_lswl(char *argv[])
 {
-	const struct mgmt_cp_pair_device *ev = param;
+	unsigned int i;
+	int fd;
 
-	char bastr[20];
-	memset(bastr, 0, 20);
+	DEBUG_PRINT("List the white list\n");
 
-	if (status) {
-#ifdef DEBUG_6LOWPAN
-		fprintf(stderr, "Pair device from index %u failed: %s %d\n",
-			PTR_TO_UINT(user_data), mgmt_errstr(status), status);
-#endif
-		mainloop_quit();
+	if (whitelist_load_locked(F_RDLCK, &fd) == -1)
 		return;
-	}
 
-	DEBUG_PRINT("Pair device complete!\r\n");
+	if (fd >= 0)
+		close(fd);
 
-	/* Change BT-LE address to string object. */
-	ba2str(&ev->addr.bdaddr, bastr);
+	for (i = 0; i < whitelist_rule_count; i++) {
+		const struct whitelist_rule *rule = &whitelist_rules[i];
 
-	if (connect_device(bastr, true))
-		printf("Device %s connect ok!\n", bastr);
-	else
-		printf("Device %s connect fail!\n", bastr);
+		if (rule->deny)
+			printf("deny %s\n", rule->rule);
+		else if (rule->profile != PROFILE_DEFAULT)
+			printf("%s %s\n", rule->rule, conn_profiles[rule->profile].name);
+		else
+			printf("%s\n", rule->rule);
+	}
 
-	mainloop_quit();
+	free(whitelist_rules);
 }
 
 
-/* Management API pair device. */
-static void pair_device(uint16_t index, const bdaddr_t *bdaddr)
+/* Fold the journal into a new whitelist snapshot */
+static void cmd_compactwl(char *argv[])
 {
-	struct mgmt_cp_pair_device cp;
+	int fd, err;
 
-#ifdef DEBUG_6LOWPAN
-	char bastr[20];
+	DEBUG_PRINT("Compact white list\n");
 
-	ba2str(bdaddr, bastr);
-	DEBUG_PRINT("Starting pairing with node: %s\n", bastr);
-#endif
+	err = whitelist_load_locked(F_WRLCK, &fd);
+	if (err == -1)
+		return;
 
-	memset(&cp, 0, sizeof(cp));
-	bacpy(&cp.addr.bdaddr, bdaddr);
-	cp.addr.type = BDADDR_LE_PUBLIC;
-	cp.io_cap = 0x02;
+	if (fd < 0) {
+		perror("Open journal failed");
+	} else if (err) {
+		/* Snapshot of the rules that fit would lose the others. */
+		fprintf(stderr, "White list does not fit the cache, not compacting\n");
+		close(fd);
+	} else {
+		if (whitelist_compact(fd) == 0)
+			printf("White list compacted, %u rules\n", whitelist_rule_count);
+		close(fd);
+	}
 
-	mgmt_send(mgmt, MGMT_OP_PAIR_DEVICE, index, sizeof(cp), &cp,
-		  pair_device_complete, UINT_TO_PTR(index), NULL);
+	free(whitelist_rules);
 }
 
 
-/* Management API set powered complete event. */
-static void set_powered_complete(uint8_t status, uint16_t len,
-				 const void *param, void *user_data)
+/* Print link quality of the connection written by the link monitor */
+static void print_link_state(const char *addr)
 {
-	uint16_t index = PTR_TO_UINT(user_data);
-	uint32_t settings;
+	FILE *fp;
+	char item[CONFIG_LINE_MAX];
 
-	if (status) {
-		fprintf(stderr, "Powering on for index %u failed: %s\n",
-						index, mgmt_errstr(status));
-		mainloop_quit();
+	fp = fopen(LINK_STATE_PATH, "r");
+	if (!fp)
 		return;
+
+	while (fgets(item, sizeof(item), fp)) {
+		if (!strncasecmp(item, addr, 17) && item[17] == ' ') {
+			item[strcspn(item, "\n")] = '\0';
+			printf(" %s", item + 18);
+			break;
+		}
 	}
 
-	settings = get_le32(param);
+	fclose(fp);
+}
 
-	if (!(settings & MGMT_SETTING_POWERED)) {
-		fprintf(stderr, "Controller is not powered\n");
-		mainloop_quit();
+
+/* List the 6lowpan connections */
+static void cmd_lscon(char *argv[])
+{
+	/* Read current connections from controller */
+	/* Format "00:11:22:33:44:55 (type 1) */
+	/* Allocate 27 byte for each connection */
+	char buffer[27*MAX_BLE_CONN];
+	char *pch;
+	int fd;
+
+	memset(buffer, 0, sizeof(buffer));
+	fd = open(CONTROLLER_PATH, O_RDONLY);
+	if (fd < 0) {
+		perror("Can not open 6lowpan controller");
 		return;
 	}
 
-	mgmt_initialized = true;
-	mainloop_quit();
+	if (read(fd, buffer, sizeof(buffer)) > 0) {
+		pch = strtok(buffer, " \n");
+		while (pch != NULL) {
+			if (strlen(pch) == 17) {
+				printf ("%s", pch);
+				print_link_state(pch);
+				printf ("\n");
+			}
+			pch = strtok (NULL, " \n");
+		}
+	}
+
+	close(fd);
+	return;
 }
 
 
-/* Management API read/set hci interface capabilities event. */
-static void read_info(uint8_t status, uint16_t len, const void *param,
-		      void *user_data)
+/* Forget the bonding keys of all nodes */
+static void cmd_clearkeys(char *argv[])
 {
-	const struct mgmt_rp_read_info *rp = param;
-	uint16_t index = PTR_TO_UINT(user_data);
-	uint32_t supported_settings;
-	uint8_t val;
+	int fd;
 
-	if (status) {
-		fprintf(stderr, "Reading info for index %u failed: %s\n",
-				index, mgmt_errstr(status));
-		mainloop_quit();
+	DEBUG_PRINT("Clear bonding keys\n");
+
+	/* Running daemon holds the keys in memory and in the kernel, it clears them all. */
+	fd = control_connect(false);
+	if (fd >= 0) {
+		if (write(fd, "clearkeys\n", 10) < 0)
+			perror("Request failed");
+		close(fd);
 		return;
 	}
 
-	supported_settings = le32_to_cpu(rp->supported_settings);
+	if (unlink(KEYS_PATH) == -1 && errno != ENOENT)
+		perror("Remove key store failed");
+}
 
-	if (!(supported_settings & MGMT_SETTING_LE)) {
-		fprintf(stderr, "Low Energy support missing\n");
-		mainloop_quit();
+
+/* Show pool usage and memory footprint of the running daemon */
+static void cmd_stats(char *argv[])
+{
+	struct timespec ts = { 0, 10 * 1000000 };
+	struct stat before, after;
+	char buf[1024];
+	FILE *fp;
+	int pid = 0, fd, i;
+	ssize_t len;
+
+	fp = fopen(pidfile_path ? pidfile_path : DEFAULT_PIDFILE, "r");
+	if (!fp || fscanf(fp, "%d", &pid) != 1 || pid <= 0) {
+		perror("Daemon is not running");
+		if (fp)
+			fclose(fp);
 		return;
 	}
+	fclose(fp);
 
-	val = 0x00;
-	mgmt_send(mgmt, MGMT_OP_SET_POWERED, index, 1, &val,
-		  set_cfg_complete, "MGMT_OP_SET_POWERED", NULL);
+	if (stat(STATS_PATH, &before) == -1)
+		memset(&before, 0, sizeof(before));
 
-	val = 0x01;
-	mgmt_send(mgmt, MGMT_OP_SET_LE, index, 1, &val,
-		  set_cfg_complete, "MGMT_OP_SET_LE", NULL);
+	if (kill(pid, SIGUSR1) == -1) {
+		perror("Signal daemon failed");
+		return;
+	}
 
-	val = 0x02;
-	mgmt_send(mgmt, MGMT_OP_SET_IO_CAPABILITY, index, 1, &val,
-		  set_cfg_complete, "MGMT_OP_SET_IO_CAPABILITY", NULL);
+	/* Wait up to one second for the daemon to write the report. */
+	for (i = 0; i < 100; i++) {
+		if (stat(STATS_PATH, &after) == 0 &&
+		    (after.st_mtim.tv_sec != before.st_mtim.tv_sec ||
+		     after.st_mtim.tv_nsec != before.st_mtim.tv_nsec))
+			break;
+		nanosleep(&ts, NULL);
+	}
 
-	val = 0x01;
-	mgmt_send(mgmt, MGMT_OP_SET_POWERED, index, 1, &val,
-		  set_powered_complete,	UINT_TO_PTR(index), NULL);
+	fd = open(STATS_PATH, O_RDONLY);
+	if (fd < 0) {
+		perror("Open stats failed");
+		return;
+	}
+
+	while ((len = read(fd, buf, sizeof(buf))) > 0)
+		fwrite(buf, 1, len, stdout);
+
+	close(fd);
 }
 
 
-/* Initialize management API. */
-static void comm_auth_init(void)
+/* Print connection and commissioning events of the running daemon */
+static void cmd_watch(char *argv[])
 {
-	mainloop_init();
+	char buf[512];
+	ssize_t len;
+	int fd;
 
-	mgmt = mgmt_new_default();
-	if (!mgmt) {
-		fprintf(stderr, "Failed to open management socket\n");
-		exit(0);
+	fd = control_connect(true);
+	if (fd < 0)
+		return;
+
+	while ((len = read(fd, buf, sizeof(buf))) > 0) {
+		fwrite(buf, 1, len, stdout);
+		fflush(stdout);
 	}
+
+	close(fd);
 }
 
 
-/* Run the main management loop */
-static void comm_auth_run(void)
+/* Ask the running daemon for a scanning cycle right away */
+static void cmd_scan(char *argv[])
 {
-	mainloop_run();
+	control_send("scan\n", true);
 }
 
 
-/* Configure management API to be able to pair devices. */
-static void comm_auth_configure(void)
+/* Reread the options file of the running daemon, as SIGHUP does. */
+static void cmd_reload(char *argv[])
 {
-	if (!mgmt_send(mgmt, MGMT_OP_READ_INFO, dev_id, 0, NULL,
-		       read_info, UINT_TO_PTR(dev_id), NULL)) {
-		fprintf(stderr, "Failed to read index list\n");
-		exit(0);
-	}
+	control_send("reload\n", true);
+}
+
+
+/* Commands */
+static struct {
+	char *cmd;
+	void (*func)(char *argv[]);
+	char *doc;
+} command[] = {
+	{ "addwl",	cmd_addwl,		"Add device into white list"	},
+	{ "denywl",	cmd_denywl,		"Exclude devices from white list" },
+	{ "rmwl",	cmd_rmwl,		"Remove device from white list"	},
+	{ "clearwl",	cmd_clearwl,		"Clear the white list"		},
+	{ "compactwl",	cmd_compactwl,		"Compact the white list journal" },
+	{ "lswl",	cmd_lswl,		"List the white list"		},
+	{ "lscon",	cmd_lscon,		"List the 6lowpan connections"	},
+	{ "clearkeys",	cmd_clearkeys,		"Forget the bonding keys"	},
+	{ "stats",	cmd_stats,		"Show daemon memory footprint"	},
+	{ "watch",	cmd_watch,		"Print daemon events"		},
+	{ "scan",	cmd_scan,		"Scan for new nodes right away"	},
+	{ "reload",	cmd_reload,		"Reread the options file"	},
+	{0}
+};
+
+/* Options */
+static struct option main_options[] = {
+	{ "device",		 1, 0, 'i'},
+	{ "use-whitelist",	 0, 0, 'W'},
+	{ "scanning window",	 1, 0, 'w'},
+	{ "scanning interval",	 1, 0, 't'},
+	{ "wifi",		 1, 0, 'n'},
+	{ "authentication",      2, 0, 'a'},
+	{ "credentials",	 1, 0, 'K'},
+	{ "kernel-discovery",	 0, 0, 'k'},
+	{ "setup",		 0, 0, 's'},
+	{ "pidfile",		 1, 0, 'P'},
+	{ "notify-fd",		 1, 0, 'N'},
+	{ "max-whitelist",	 1, 0, 'M'},
+	{ "profile",		 1, 0, 'p'},
+	{ "probe-interval",	 1, 0, 'e'},
+	{ "probe-target",	 1, 0, 'E'},
+	{ "iface",		 1, 0, 'I'},
+	{ "iface-addr",		 1, 0, 'A'},
+	{ "iface-hook",		 1, 0, 'H'},
+	{ "match",		 1, 0, 'r'},
+	{ "max-backoff",	 1, 0, 'b'},
+	{ "direct",		 0, 0, 'D'},
+	{ "max-rss",		 1, 0, 'm'},
+	{ "max-nodes",		 1, 0, 'C'},
+	{ "link-interval",	 1, 0, 'L'},
+	{ "recycle-rssi",	 1, 0, 'R'},
+	{ "le-interval",	 1, 0, 'T'},
+	{ "le-window",		 1, 0, 'X'},
+	{ "config",		 1, 0, 'c'},
+	{ "daemonize",		 0, 0, 'd'},
+	{ "help",		 0, 0, 'h'},
+	{0}
+};
+
+
+/* Flag options are set on the command line, the options file may also clear them. */
+static bool option_flag(const char *arg)
+{
+	return !arg || !*arg || !strcmp(arg, "1") || !strcmp(arg, "yes") ||
+	       !strcmp(arg, "true") || !strcmp(arg, "on");
 }
 
 
-/* Pair device using passkey authentication. */
-static void comm_auth_pair(char *addr)
+/* Apply one option, given on the command line or in the options file. */
+static int option_set(int opt, char *arg)
 {
-	bdaddr_t peeraddr;
+	switch (opt) {
+	case 'i':
+		printf("Use hci interface: %s\n", arg);
+		hci_id = arg;
+		break;
+	case 'W':
+		whitelist_enabled = option_flag(arg);
+		if (whitelist_enabled)
+			printf("use white list\n");
+		break;
+	case 'w':
+		{
+			unsigned int input_window;
+
+			if (parse_duration(arg, &input_window) == -1 ||
+			    input_window < MIN_SCANNING_TIME ||
+			    input_window > MAX_SCANNING_WINDOW) {
+				perror("Window should be between 10ms ~ 30 seconds");
+				return -1;
+			}
 
-	str2ba(addr, &peeraddr);
+			printf("Set scanning window to %u ms\n", input_window);
+			scanning_window = input_window;
+		}
+		break;
+	case 't':
+		{
+			unsigned int input_interval;
+
+			if (parse_duration(arg, &input_interval) == -1 ||
+			    input_interval < MIN_SCANNING_TIME ||
+			    input_interval > MAX_SCANNING_INTERVAL) {
+				perror("Interval should be between 10ms ~ 300 seconds");
+				return -1;
+			}
 
-	/* Register user passkey request event. */
-	mgmt_register(mgmt, MGMT_EV_USER_PASSKEY_REQUEST, dev_id,
-		      passkey_request_event, UINT_TO_PTR(dev_id), NULL);
+			printf("Set scanning interval to %u ms\n", input_interval);
+			scanning_interval = input_interval;
+		}
+		break;
+	case 'b':
+		if (parse_number(arg, 1, 1024, &scan_backoff_max) == -1) {
+			perror("Backoff should be between 1 and 1024");
+			return -1;
+		}
+		break;
+	case 'T':
+	case 'X':
+		{
+			unsigned int value;
+
+			if (parse_number(arg, LE_SCAN_TIME_MIN, LE_SCAN_TIME_MAX, &value) == -1) {
+				perror("LE scan interval and window should be between 4 and 16384 (0.625 ms units)");
+				return -1;
+			}
 
-	pair_device(dev_id, &peeraddr);
-}
+			if (opt == 'T')
+				le_scan_interval = value;
+			else
+				le_scan_window = value;
+		}
+		break;
+	case 'a':
+		{
+			if (arg && *arg) {
+				/* Pairs of the credentials file and WiFi are read afterwards. */
+				auth_creds_truncate(auth_arg_count);
+
+				if (read_manual_cfg(arg) == -1)	{
+					perror("Cannot read authentication configuration. Use SSID:PASSKEY syntax.");
+					return -1;
+				}
 
+				auth_arg_count = auth_cred_count;
+				if (auth_type == COMMISSIONING_AUTH_NONE)
+					auth_type = COMMISSIONING_AUTH_MANUAL;
 
-/* main process to scan/connect all IPSP slaves */
-static void process_6lowpan(char *hci_id, bool use_whitelist)
-{
-	int dd;
+			} else {
+				auth_type = COMMISSIONING_AUTH_WIFI_CFG;
+			}
 
-	dev_id = hci_devid(hci_id);
-	if (dev_id < 0) {
-		perror("Could not open device");
-		exit(0);
-	}
+			DEBUG_PRINT("Authentication parameteres:\r\nPAIRS:\t%u\r\nTYPE:\t%d\r\n", auth_arg_count, auth_type);
+		}
+		break;
+	case 'K':
+		free(auth_creds_path);
+		auth_creds_path = strdup(arg);
+		if (auth_type == COMMISSIONING_AUTH_NONE)
+			auth_type = COMMISSIONING_AUTH_MANUAL;
+		break;
+	case 'D':
+		direct_connect = option_flag(arg);
+		if (direct_connect)
+			printf("Connect white listed nodes directly\n");
+		break;
+	case 'k':
+		kernel_discovery = option_flag(arg);
+		if (kernel_discovery)
+			printf("Use kernel discovery\n");
+		break;
+	case 's':
+		setup_6lowpan = option_flag(arg);
+		if (setup_6lowpan)
+			printf("Setup 6lowpan module\n");
+		break;
+	case 'P':
+		pidfile_path = arg;
+		break;
+	case 'N':
+		if (parse_signed(arg, 0, INT_MAX, &notify_fd) == -1) {
+			perror("Notify fd should be a file descriptor number");
+			return -1;
+		}
+		break;
+	case 'M':
+		if (parse_number(arg, 1, POOL_SIZE_MAX, &pools[POOL_WHITELIST].size) == -1) {
+			perror("Whitelist cache should have 1 to 65536 entries");
+			return -1;
+		}
+		break;
+	case 'C':
+		/* Queued nodes are never evicted, one more slot has to stay free for new ones. */
+		if (parse_number(arg, MAX_BLE_CONN + 1, POOL_SIZE_MAX,
+				 &pools[POOL_NODES].size) == -1) {
+			perror("Scheduler should track 9 to 65536 nodes");
+			return -1;
+		}
+		break;
+	case 'L':
+		if (!strcmp(arg, "0")) {
+			link_interval = 0;
+		} else if (parse_duration(arg, &link_interval) == -1 ||
+			   link_interval < MIN_SCANNING_TIME) {
+			perror("Link interval should be at least 10ms");
+			return -1;
+		}
+		break;
+	case 'R':
+		/* HCI reports -127 to 20 dBm. */
+		if (parse_signed(arg, -127, 20, &link_rssi_threshold) == -1) {
+			perror("Recycle RSSI should be between -127 and 20 dBm");
+			return -1;
+		}
+		printf("Recycle links below %d dBm\n", link_rssi_threshold);
+		break;
+	case 'p':
+		{
+			int profile = conn_profile_find(arg);
 
-	DEBUG_PRINT("HCI Device ID = %d\r\n", dev_id);
+			if (profile < 0) {
+				perror("Profile should be default, throughput or lowpower");
+				return -1;
+			}
 
-	dd = hci_open_dev(dev_id);
-	if (dd < 0) {
-		perror("Could not open device");
-		exit(0);
-	}
+			printf("Use %s connection parameters\n", arg);
+			default_profile = profile;
+		}
+		break;
+	case 'e':
+		if (parse_duration(arg, &probe_interval) == -1 ||
+		    probe_interval < MIN_SCANNING_TIME) {
+			perror("Probe interval should be at least 10ms");
+			return -1;
+		}
+		break;
+	case 'E':
+		if (probe_target_count == MAX_PROBE_TARGETS || bachk(arg) < 0) {
+			perror("Give up to 4 probe targets as BDADDR");
+			return -1;
+		}
+		str2ba(arg, &probe_targets[probe_target_count++]);
+		break;
+	case 'I':
+		lowpan_iface = arg;
+		break;
+	case 'A':
+		{
+			char *slash = strchr(arg, '/'), *end;
+			unsigned int i = netif_addr_count;
+			unsigned long prefixlen;
+
+			if (i == MAX_IFACE_ADDRS || !slash) {
+				perror("Give up to 4 addresses as ADDR/PREFIXLEN");
+				return -1;
+			}
 
-	if (auth_type != COMMISSIONING_AUTH_NONE) {
-		comm_auth_init();
-		comm_auth_configure();
-		comm_auth_run();
+			*slash = '\0';
+			errno = 0;
+			prefixlen = strtoul(slash + 1, &end, 10);
+			if (inet_pton(AF_INET6, arg, &netif_addrs[i].addr) != 1 ||
+			    errno || end == slash + 1 || *end || prefixlen > 128) {
+				perror("Address should be an IPv6 ADDR/PREFIXLEN");
+				return -1;
+			}
 
-		if (!mgmt_initialized) {
-			perror("Could not initialize authentication");
-			exit(0);
+			netif_addrs[i].prefixlen = prefixlen;
+			netif_addr_count++;
 		}
-	}
+		break;
+	case 'H':
+		free(lowpan_hook);
+		lowpan_hook = strdup(arg);
+		break;
+	case 'r':
+		if (match_rule_arg_count == MAX_MATCH_RULES ||
+		    strlen(arg) >= CONFIG_LINE_MAX) {
+			perror("Give up to 8 match rules");
+			return -1;
+		}
+		strcpy(match_rule_args[match_rule_arg_count++], arg);
+		break;
+	case 'm':
+		{
+			unsigned int budget;
 
-	while (1) {
-		char addr[DEVICE_ADDR_LEN];
-		char name[DEVICE_NAME_LEN];
-		bool scan_ret;
-
-		/* Scan the IPSP device */
-		if (current_conn_num(dev_id) < MAX_BLE_CONN) {
-			scan_ret = scan_ipsp_device(dd, scanning_window, name, addr, use_whitelist);
-			if (scan_ret) {
-				if (auth_type != COMMISSIONING_AUTH_NONE) {
-					DEBUG_PRINT("Pairing with device %s\r\n", addr);
-
-					comm_auth_init();
-					comm_auth_pair(addr);
-					comm_auth_run();
-				} else {
-					if (connect_device(addr, true))
-						printf("Device %s connect ok!\n", addr);
-					else
-						printf("Device %s connect fail!\n", addr);
-				}
+			if (parse_number(arg, 0, UINT_MAX, &budget) == -1) {
+				perror("Memory budget should be given in kB");
+				return -1;
 			}
+			max_rss = budget;
 		}
+		printf("Set memory budget to %lu kB\n", max_rss);
+		break;
+	case 'd':
+		daemonize = option_flag(arg);
+		if (daemonize)
+			printf("Daemonize\n");
+		break;
+	case 'n':
+		auth_wifi_iface = strcmp(arg, "all") ? atoi(arg) : AUTH_WIFI_ALL;
+		printf("Use WiFi interface: %d\n", auth_wifi_iface);
+		break;
+	default:
+		return -1;
+	}
 
-		/* Stop running if the daemon receives interrupt signal */
-		if (signal_received == SIGINT) {
-			break;
-		}
+	return 0;
+}
 
-		/* Wait for scanning_interval second till next scanning */
-		sleep(scanning_interval);
-	}
 
-	if (dd >= 0)
-		hci_close_dev(dd);
+/* Long option names double as keys of the options file, with '-' for spaces. */
+static const struct option *option_find(const char *key)
+{
+	const struct option *o;
+	const char *name, *k;
 
-	if (auth_type != COMMISSIONING_AUTH_NONE)
-		mgmt_unref(mgmt);
+	for (o = main_options; o->name; o++) {
+		for (name = o->name, k = key; *name && *k; name++, k++) {
+			if (*name != *k && !(*name == ' ' && *k == '-'))
+				break;
+		}
 
-	return;
+		if (!*name && !*k)
+			return o;
+	}
+
+	return NULL;
 }
 
 
-/* Add device into white list */
-static void cmd_addwl(char *argv)
+/* Remember a startup value of a restart-only option, it may be given several times. */
+static void option_fixed_add(int opt, const char *value)
 {
-	FILE *fp = NULL;
-	char item[CONFIG_LINE_MAX];
-	struct flock lock;
+	char *fixed = options_fixed[opt];
 
-	DEBUG_PRINT("Add %s to white list\n", argv);
-
-	if (strlen(argv) != 17) {
-		perror("input address not correct");
+	if (!fixed) {
+		options_fixed[opt] = strdup(value);
 		return;
 	}
 
-	while (access(CONFIG_SWP_PATH, F_OK) != -1) {
-		/* Wait if swap file exists */
-		sleep(1);
-	}
+	options_fixed[opt] = malloc(strlen(fixed) + strlen(value) + 2);
+	if (options_fixed[opt])
+		sprintf(options_fixed[opt], "%s\n%s", fixed, value);
+	free(fixed);
+}
 
-	do {
-		if (fp != NULL)
-			fclose(fp);
 
-		fp = fopen(CONFIG_PATH, "a+");
-		if (!fp) {
-			perror("Open config failed");
-			return;
-		}
+/* Check if a restart-only option had the value at startup. */
+static bool option_fixed_has(int opt, const char *value)
+{
+	const char *fixed = options_fixed[opt];
+	size_t len = strlen(value);
 
-		lock.l_type = F_WRLCK;
-		lock.l_start = 0;
-		lock.l_whence = SEEK_SET;
-		lock.l_len = 0;
-		lock.l_pid = getpid();
-	} while ((fcntl(fileno(fp), F_SETLK, &lock) == -1) && ((errno == EAGAIN) || (errno == EACCES)));
+	while (fixed) {
+		if (!strncmp(fixed, value, len) && (fixed[len] == '\n' || !fixed[len]))
+			return true;
 
-	/* Find address in 6lowpan.conf */
-	while (fgets(item, sizeof(item), fp)) {
-		char *pch;
-
-		/* Stop adding address if the address already exist */
-		pch = strstr(item, "address");
-		if (pch) {
-			if (!strncasecmp(pch+9, argv, 17)) {
-				DEBUG_PRINT("address is already in white list\n");
-				fclose(fp);
-				return;
-			}
-		}
-		memset(item, 0, sizeof(item));
+		fixed = strchr(fixed, '\n');
+		if (fixed)
+			fixed++;
 	}
 
-	fprintf(fp, "{\n\taddress=\"%s\"\n}\n", argv);
-	fflush(fp);
-	fsync(fileno(fp));
-	fclose(fp);
+	return false;
 }
 
 
-/* Remove device into white list */
-static void cmd_rmwl(char *argv)
+/* Parse one "key = value" line of the options file. */
+static bool parse_options_line(char *line, void *user_data)
 {
-	FILE *fp_cur = NULL, *fp_swp = NULL;
-	char item[CONFIG_LINE_MAX];
-	struct flock lock_cur, lock_swp;
+	struct options_parse *op = user_data;
+	const struct option *o;
+	char *key, *value, *end;
 
-	DEBUG_PRINT("Remove %s from white list\n", argv);
+	op->line++;
 
-	if (strlen(argv) != 17) {
-		perror("input address not correct");
-		return;
-	}
+	while (isspace((unsigned char) *line))
+		line++;
 
-	while (access(CONFIG_SWP_PATH, F_OK) != -1) {
-		/* Wait if swap file exists */
-		sleep(1);
-	}
+	if (!*line || *line == '#')
+		return true;
 
-	do {
-		if (fp_cur != NULL) {
-			fclose(fp_cur);
-		}
+	key = line;
+	while (*line && *line != '=' && !isspace((unsigned char) *line))
+		line++;
 
-		fp_cur = fopen(CONFIG_PATH, "a+");
-		if (!fp_cur) {
-			perror("Open config failed");
-			goto done;
-		}
+	end = line;
+	while (isspace((unsigned char) *line) || *line == '=')
+		line++;
+	*end = '\0';
 
-		lock_cur.l_type = F_WRLCK;
-		lock_cur.l_start = 0;
-		lock_cur.l_whence = SEEK_SET;
-		lock_cur.l_len = 0;
-		lock_cur.l_pid = getpid();
-	} while ((fcntl(fileno(fp_cur), F_SETLK, &lock_cur) == -1) && ((errno == EAGAIN) || (errno == EACCES)));
+	value = line;
+	for (end = value + strlen(value); end > value && isspace((unsigned char) end[-1]); end--)
+		;
+	*end = '\0';
 
-	do {
-		if (fp_swp != NULL)
-			fclose(fp_swp);
-
-		fp_swp = fopen(CONFIG_SWP_PATH, "w");
-		if (!fp_swp) {
-			perror("Open swap config failed");
-			goto done;
-		}
-
-		lock_swp.l_type = F_WRLCK;
-		lock_swp.l_start = 0;
-		lock_swp.l_whence = SEEK_SET;
-		lock_swp.l_len = 0;
-		lock_swp.l_pid = getpid();
-	} while ((fcntl(fileno(fp_swp), F_SETLK, &lock_swp) == -1) && ((errno == EAGAIN) || (errno == EACCES)));
-
-	/* check address in conf */
-	while (fgets(item, sizeof(item), fp_cur)) {
-		if (item[0] == '{') {
-			char *pch;
-			memset(item, 0, sizeof(item));
-			while (fgets(item, sizeof(item), fp_cur)) {
-				if (item[0] == '}')
-					break;
-
-				pch = strstr(item, "address");
-				if (pch) {
-					if (!strncasecmp(pch+9, argv, 17))
-						continue;
-					else
-						fprintf (fp_swp, "{\n%s}\n", item);
-				}
-			}
-		}
-		memset(item, 0, sizeof(item));
+	o = option_find(key);
+	if (!o || o->val == 'c' || o->val == 'h' || (o->has_arg == 1 && !*value)) {
+		fprintf(stderr, "%s:%u: invalid option %s\n", options_path, op->line, key);
+		op->errors++;
+		return true;
 	}
 
-done:
-	if (!fp_cur) {
-		fflush(fp_cur);
-		fsync(fileno(fp_cur));
-		fclose(fp_cur);
-	}
-	if (!fp_swp) {
-		fflush(fp_swp);
-		fsync(fileno(fp_swp));
-		fclose(fp_swp);
+	/* Command line wins over the file, also on reload. */
+	if (options_argv[o->val])
+		return true;
+
+	/* Options which size memory or select the controller are read once. */
+	if (strchr(OPTIONS_RESTART, o->val)) {
+		if (op->reload) {
+			if (!option_fixed_has(o->val, value))
+				fprintf(stderr, "%s:%u: %s takes effect after a restart\n",
+					options_path, op->line, key);
+			return true;
+		}
+
+		option_fixed_add(o->val, value);
 	}
 
-	if (rename(CONFIG_SWP_PATH, CONFIG_PATH) == -1)
-		perror("Rename Fail");
+	/* Values given at startup are kept like the command line arguments. */
+	if (!op->reload)
+		value = strdup(value);
 
-	if (connect_device(argv, false))
-		printf("Device %s disconnect ok!\n", argv);
-	else
-		printf("Device %s disconnect fail!\n", argv);
+	if (!value || option_set(o->val, value) == -1) {
+		fprintf(stderr, "%s:%u: invalid value of %s\n", options_path, op->line, key);
+		op->errors++;
+	}
+
+	return true;
 }
 
 
-/* Clear the content of white list */
-static void cmd_clearwl(char *argv)
+/* Apply the options file, returns the number of invalid lines or -1 if unreadable. */
+static int options_load(bool reload)
 {
-	FILE *fp = NULL;
-
-	DEBUG_PRINT("Clear white list\n");
+	struct options_parse op;
+	int fd;
 
-	while (access(CONFIG_SWP_PATH, F_OK) != -1) {
-		/* Wait if swap file exists */
-		sleep(1);
+	fd = open(options_path, O_RDONLY);
+	if (fd < 0) {
+		/* Default options file is optional. */
+		if (options_given || errno != ENOENT) {
+			perror("Could not open options file");
+			return -1;
+		}
+		return reload ? -1 : 0;
 	}
 
-	fp = fopen(CONFIG_PATH, "w");
-	if (!fp) {
-		perror("Open config failed");
-		return;
-	}
+	memset(&op, 0, sizeof(op));
+	op.reload = reload;
 
-	fclose(fp);
+	for_each_line(fd, parse_options_line, &op);
+	close(fd);
+
+	return op.errors;
 }
 
 
-/* List the content of white list */
-static void cmd_lswl(char *argv)
+/* Apply the options file again in place, links and scanning state are kept. */
+static void options_reload(void)
 {
-	FILE *fp = NULL;
-	char item[CONFIG_LINE_MAX];
-	struct flock lock;
+	struct match_rule rules[MAX_MATCH_RULES];
+	struct auth_cred creds[MAX_AUTH_CREDS];
+	unsigned int rule_count = match_rule_count, rule_args = match_rule_arg_count;
+	unsigned int cred_count = auth_cred_count, arg_count = auth_arg_count;
+	unsigned int auth = auth_type;
+	bool whitelist_was = whitelist_enabled;
+	uint16_t interval = le_scan_interval, window = le_scan_window;
+	unsigned int link_was = link_interval;
+	char *creds_path = auth_creds_path;
+	int err;
 
-	DEBUG_PRINT("List the white list\n");
+	memcpy(rules, match_rules, sizeof(rules));
+	memcpy(creds, auth_creds, sizeof(creds));
 
-	while (access(CONFIG_SWP_PATH, F_OK) != -1) {
-		/* Wait if swap file exists */
-		sleep(1);
-	}
+	/* Rules and credentials the file no longer lists are dropped, argv ones stay. */
+	if (!options_argv['r'])
+		match_rule_arg_count = 0;
+	if (!options_argv['a'])
+		auth_arg_count = 0;
+	if (!options_argv['K'])
+		auth_creds_path = NULL;
+	if (!options_argv['a'] && !options_argv['K'])
+		auth_type = COMMISSIONING_AUTH_NONE;
 
-	do {
-		if (fp != NULL)
-			fclose(fp);
+	err = options_load(true);
+	if (err < 0) {
+		/* File could not be read, nothing of it was applied. */
+		match_rule_arg_count = rule_args;
+		auth_arg_count = arg_count;
+		auth_creds_path = creds_path;
+		auth_type = auth;
+		return;
+	}
 
-		fp = fopen(CONFIG_PATH, "a+");
-		if (!fp) {
-			perror("Open config failed");
-			return;
-		}
+	/* Settings which need the controller set up differently are kept. */
+	if (kernel_discovery && whitelist_enabled != whitelist_was) {
+		fprintf(stderr, "White list mode of kernel discovery takes effect after a restart\n");
+		whitelist_enabled = whitelist_was;
+	}
 
-		lock.l_type = F_WRLCK;
-		lock.l_start = 0;
-		lock.l_whence = SEEK_SET;
-		lock.l_len = 0;
-		lock.l_pid = getpid();
-	} while ((fcntl(fileno(fp), F_SETLK, &lock) == -1) && ((errno == EAGAIN) || (errno == EACCES)));
+	/* Passkey handler, bonding and keys are set up at startup only. */
+	if (auth == COMMISSIONING_AUTH_NONE && auth_type != COMMISSIONING_AUTH_NONE) {
+		fprintf(stderr, "Authentication takes effect after a restart\n");
+		memcpy(auth_creds, creds, sizeof(creds));
+		auth_arg_count = arg_count;
+		auth_creds_truncate(cred_count);
+		auth_type = COMMISSIONING_AUTH_NONE;
+		free(auth_creds_path);
+		auth_creds_path = creds_path;
+	} else if (auth != COMMISSIONING_AUTH_NONE && auth_type == COMMISSIONING_AUTH_NONE) {
+		/* Handlers stay registered, passkey requests are refused. */
+		fprintf(stderr, "No credentials left, pairing is refused\n");
+		auth_type = COMMISSIONING_AUTH_MANUAL;
+		auth_creds_truncate(0);
+	}
 
-	/* Find address in 6lowpan.conf */
-	while (fgets(item, sizeof(item), fp)) {
-		char *pch;
-		char bd_addr[18];
-
-		pch = strstr(item, "address");
-		if (pch) {
-			if (strncpy(bd_addr, pch+9, sizeof(bd_addr)) != NULL) {
-				bd_addr[17] = '\0';
-				printf("%s\n", bd_addr);
-			}
+	/* Credentials file and WiFi sections are reread as well. */
+	if (auth_type == COMMISSIONING_AUTH_WIFI_CFG || auth_creds_path) {
+		wifi_cfg_loaded = false;
+		if (read_wifi_cfg() == -1) {
+			fprintf(stderr, "Authentication kept\n");
+			memcpy(auth_creds, creds, sizeof(creds));
+			auth_arg_count = arg_count;
+			auth_creds_truncate(cred_count);
+			auth_type = auth;
+			free(auth_creds_path);
+			auth_creds_path = creds_path;
 		}
-		memset(item, 0, sizeof(item));
 	}
 
-	fclose(fp);
-}
+	if (auth_creds_path != creds_path)
+		free(creds_path);
 
+	if (auth_type != auth || auth_cred_count != cred_count ||
+	    memcmp(creds, auth_creds, cred_count * sizeof(creds[0])))
+		printf("Authentication updated, %u networks, used from the next pairing\n",
+		       auth_cred_count);
 
-/* List the 6lowpan connections */
-static void cmd_lscon(char *argv)
-{
-	/* Read current connections from controller */
-	/* Format "00:11:22:33:44:55 (type 1) */
-	/* Allocate 27 byte for each connection */
-	char buffer[27*MAX_BLE_CONN];
-	char *pch;
-	int fd;
+	if (le_scan_window > le_scan_interval) {
+		fprintf(stderr, "LE scan window exceeds the LE scan interval, kept\n");
+		le_scan_interval = interval;
+		le_scan_window = window;
+	}
 
-	memset(buffer, 0, sizeof(buffer));
-	fd = open(CONTROLLER_PATH, O_RDONLY);
-	if (fd < 0) {
-		perror("Can not open 6lowpan controller");
-		return;
+	if (direct_connect && (!whitelist_enabled || kernel_discovery)) {
+		fprintf(stderr, "Direct connect needs -W and userspace scanning\n");
+		direct_connect = false;
 	}
 
-	if (read(fd, buffer, sizeof(buffer)) > 0) {
-		pch = strtok(buffer, " \n");
-		while (pch != NULL) {
-			if (strlen(pch) == 17)
-				printf ("%s\n", pch);
-			pch = strtok (NULL, " \n");
-		}
+	if (match_init() == -1) {
+		memcpy(match_rules, rules, sizeof(rules));
+		match_rule_count = rule_count;
 	}
 
-	close(fd);
-	return;
-}
+	if (scan_backoff > scan_backoff_max)
+		scan_backoff = scan_backoff_max;
 
+	if (whitelist_enabled && !whitelist_was)
+		whitelist_reload();
 
-/* Commands */
-static struct {
-	char *cmd;
-	void (*func)(char *argv);
-	char *doc;
-} command[] = {
-	{ "addwl",	cmd_addwl,		"Add device into white list"	},
-	{ "rmwl",	cmd_rmwl,		"Remove device from white list"	},
-	{ "clearwl",	cmd_clearwl,		"Clear the white list"		},
-	{ "lswl",	cmd_lswl,		"List the white list"		},
-	{ "lscon",	cmd_lscon,		"List the 6lowpan connections"	},
-	{0}
-};
+	if (link_interval != link_was) {
+		if (link_timeout_id >= 0 && !link_interval)
+			timeout_disarm(link_timeout_id);
+		else if (link_timeout_id >= 0)
+			mainloop_modify_timeout(link_timeout_id, link_interval);
+		else if (link_interval)
+			link_timeout_id = mainloop_add_timeout(link_interval, link_timeout,
+							       NULL, NULL);
+	}
 
-/* Options */
-static struct option main_options[] = {
-	{ "device",		 1, 0, 'i'},
-	{ "use-whitelist",	 0, 0, 'W'},
-	{ "scanning window",	 1, 0, 'w'},
-	{ "scanning interval",	 1, 0, 't'},
-	{ "wifi",		 1, 0, 'n'},
-	{ "authentication",      2, 0, 'a'},
-	{ "daemonize",		 0, 0, 'd'},
-	{ "help",		 0, 0, 'h'},
-	{0}
-};
+	if (probe_interval && probe_timeout_id < 0)
+		probe_init();
+
+	printf("Reloaded options from %s\n", options_path);
+}
 
 
 int main(int argc, char *argv[])
 {
 	int opt, i, j, optindex;
-	char *hci_id = NULL;
-	bool use_whitelist = false, daemonize = false;
-
-	while ((opt = getopt_long(argc, argv, "i:Ww:t:dhn:a::", main_options, &optindex)) != -1) {
-		switch (opt) {
-		case 'i':
-			printf("Use hci interface: %s\n", optarg);
-			hci_id = optarg;
-			break;
-		case 'W':
-			printf("use white list\n");
-			use_whitelist = true;
-			break;
-		case 'w':
-			{
-				unsigned int input_window;
-				input_window = atoi(optarg);
-				printf("Set scanning window to %d\n", input_window);
-				if (input_window > 0 && input_window <= MAX_SCANNING_WINDOW) {
-					scanning_window = input_window;
-				} else {
-					perror("Interval should be between 0 ~ 30 seconds");
-					exit(-1);
-				}
-			}
-			break;
-		case 't':
-			{
-				unsigned int input_interval;
-				input_interval = atoi(optarg);
-				printf("Set scanning interval to %d\n", input_interval);
-				if (input_interval > 0 && input_interval <= MAX_SCANNING_INTERVAL) {
-					scanning_interval = input_interval;
-				} else {
-					perror("Interval should be between 0 ~ 300 seconds");
-					exit(-1);
-				}
-			}
-			break;
-		case 'a':
-			{
-				char *auth_optarg = optarg;
 
-				if (!optarg && NULL != argv[optind] && '-' != argv[optind][0])
-					auth_optarg = argv[optind++];
+	/* Options file is located first, its keys are checked against the command line. */
+	for (i = 1; i < argc; i++) {
+		const char *path;
 
-				if (auth_optarg) {
-					if (read_manual_cfg(auth_optarg) == -1)	{
-						perror("Cannot read authentication configuration. Use SSID:PASSKEY syntax.");
-						exit(-1);
-					}
+		if (!strcmp(argv[i], "-c") || !strcmp(argv[i], "--config"))
+			path = argv[i + 1];
+		else if (!strncmp(argv[i], "--config=", 9))
+			path = argv[i] + 9;
+		else if (!strncmp(argv[i], "-c", 2))
+			path = argv[i] + 2;
+		else
+			continue;
 
-					auth_type = COMMISSIONING_AUTH_MANUAL;
+		if (!path)
+			break;
 
-				} else {
-					auth_type = COMMISSIONING_AUTH_WIFI_CFG;
-				}
+		/* Reloads happen after daemon() changed to the root directory. */
+		options_path = realpath(path, NULL);
+		if (!options_path)
+			options_path = path;
+		options_given = true;
+	}
 
-				DEBUG_PRINT("Authentication parameteres:\r\nSSID:\t%s\r\nKEY:\t%s\r\nTYPE:\t%d\r\n", auth_ssid_value, auth_key_value, auth_type);
-			}
-			break;
-		case 'd':
-			printf("Daemonize\n");
-			daemonize = true;
-			break;
-		case 'n':
-			auth_wifi_iface = atoi(optarg);
-			printf("Use WiFi interface: %d\n", auth_wifi_iface);
+	while ((opt = getopt_long(argc, argv, "i:WDw:t:b:dhksP:N:M:m:C:L:R:p:e:E:I:A:H:r:n:K:T:X:c:a::", main_options, &optindex)) != -1) {
+		switch (opt) {
+		case 'c':
+			/* Options file is read before the other options. */
 			break;
 		case 'h':
-		default:
+		case '?':
 			usage();
 			exit(0);
+		case 'a':
+			if (!optarg && NULL != argv[optind] && '-' != argv[optind][0])
+				optarg = argv[optind++];
+			/* fall through */
+		default:
+			if (option_set(opt, optarg) == -1)
+				exit(-1);
+			options_argv[opt] = true;
+			break;
+		}
+	}
+
+	/* Command is the first argument which is not an option, matched whole. */
+	if (optind < argc) {
+		for (j = 0; command[j].cmd; j++) {
+			if (strcmp(command[j].cmd, argv[optind]))
+				continue;
+			command[j].func(argv + optind + 1);
+			exit(0);
 		}
+
+		fprintf(stderr, "Unknown command %s\n", argv[optind]);
+		usage();
+		exit(-1);
 	}
 
-	if(auth_type == COMMISSIONING_AUTH_WIFI_CFG)
+	/* Options file is for the daemon, commands take the command line only. */
+	if (options_load(false))
+		exit(-1);
+
+	if(auth_type == COMMISSIONING_AUTH_WIFI_CFG || auth_creds_path)
 	{
 		if (read_wifi_cfg() == -1) {
-			perror("Cannot read Wifi configuration.");
+			perror("Cannot read authentication configuration.");
 			exit(-1);
 		}
 	}
 
-	for (i = 0; i < argc ; i++) {
-		for (j = 0; command[j].cmd; j++) {
-			if (strncmp(command[j].cmd, argv[i], strlen(command[j].cmd)))
-				continue;
-			command[j].func(argv[i+1]);
-			exit(0);
-		}
+	if (direct_connect && (!whitelist_enabled || kernel_discovery)) {
+		fprintf(stderr, "Direct connect needs -W and userspace scanning\n");
+		exit(-1);
+	}
+
+	if (le_scan_window > le_scan_interval) {
+		fprintf(stderr, "LE scan window should not exceed the LE scan interval\n");
+		exit(-1);
+	}
+
+	if (match_init() == -1)
+		exit(-1);
+
+	if (setup_6lowpan && setup_module() == -1) {
+		perror("Could not setup 6lowpan");
+		exit(-1);
 	}
 
 	if (daemonize) {
@@ -1271,10 +6804,10 @@ int main(int argc, char *argv[])
 
 	if (hci_id != NULL) {
 		printf("Run 6lowpan on interface %s\n", hci_id);
-		process_6lowpan(hci_id, use_whitelist);
+		process_6lowpan(hci_id);
 	} else {
 		printf("Run 6lowpan on default interface hci0\n");
-		process_6lowpan("hci0", use_whitelist);
+		process_6lowpan("hci0");
 	}
 
 